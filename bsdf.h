@@ -0,0 +1,122 @@
+#pragma once
+#include "vec3.h"
+#include "constant.h"
+#include "material.h"
+#include "helper.h"
+#include "sampler.h"
+
+// below this GGX alpha the reflection is treated as a perfect mirror
+const float BSDF_MIRROR_ALPHA = 1e-3f;
+
+// direction chosen by BSDF::sample
+struct BSDFSample {
+    Vec3 direction = VEC3_ZERO;
+    // bsdf * cosine / pdf, what the path throughput is multiplied by
+    Vec3 weight = VEC3_ZERO;
+    // solid angle density, 0 for a mirror reflection that no other technique can find
+    float pdf = 0;
+};
+
+// opaque surface: lambertian lobe of the surface color and GGX reflection lobe of the specular color
+// metal is the weight of the reflection lobe and roughness its GGX alpha square root
+// directions point away from the surface, wo toward the viewer
+class BSDF {
+private:
+    Vec3 normal;
+    Vec3 diffuse_color;
+    Vec3 specular_color;
+    float metal;
+    float alpha;
+
+    // GGX normal distribution, cos_m is the cosine between the microfacet and the normal
+    float ggx_D(float cos_m) const {
+        float a2 = alpha * alpha;
+        float d = cos_m * cos_m * (a2 - 1) + 1;
+        return a2 / (M_PI * d * d);
+    }
+    // smith masking of one direction
+    float ggx_G1(float cos_v) const {
+        float a2 = alpha * alpha;
+        return 2 * cos_v / (cos_v + sqrt(a2 + (1 - a2) * cos_v * cos_v));
+    }
+    bool mirror() const {
+        return alpha < BSDF_MIRROR_ALPHA;
+    }
+    // density of wi when the microfacet normal is sampled from D * cos
+    float specular_pdf(Vec3 wo, Vec3 wi) const {
+        Vec3 m = (wo + wi).normalize();
+        float cos_m = m.dot(normal);
+        float wo_m = wo.dot(m);
+        if(cos_m <= 0 or wo_m <= 0) return 0;
+        return ggx_D(cos_m) * cos_m / (4 * wo_m);
+    }
+public:
+    BSDF(Vec3 n, const Material &material, Vec3 color)
+        : normal(n), diffuse_color(color), specular_color(material.specular_color),
+          metal(material.metal), alpha(material.roughness * material.roughness) {}
+
+    // a mirror only surface can not be reached by light sampling
+    bool is_delta() const {
+        return metal >= 1 and mirror();
+    }
+
+    // bsdf times the cosine of wi
+    Vec3 eval(Vec3 wo, Vec3 wi) const {
+        float cos_i = wi.dot(normal);
+        float cos_o = wo.dot(normal);
+        if(cos_i <= 0 or cos_o <= 0) return BLACK;
+        Vec3 f = diffuse_color * ((1 - metal) * cos_i / M_PI);
+        if(metal > 0 and !mirror()) {
+            Vec3 m = (wo + wi).normalize();
+            float cos_m = m.dot(normal);
+            f += specular_color * (metal * ggx_D(cos_m) * ggx_G1(cos_o) * ggx_G1(cos_i) / (4 * cos_o));
+        }
+        return f;
+    }
+    // density sample() give to wi, the mirror lobe excluded
+    float pdf(Vec3 wo, Vec3 wi) const {
+        float cos_i = wi.dot(normal);
+        if(cos_i <= 0 or wo.dot(normal) <= 0) return 0;
+        float p = (1 - metal) * cos_i / M_PI;
+        if(metal > 0 and !mirror()) p += metal * specular_pdf(wo, wi);
+        return p;
+    }
+
+    // pick the reflection lobe with probability metal, false if the path must stop
+    bool sample(Vec3 wo, Sampler &rng, BSDFSample &s) const {
+        // the 2D pair first, see SAMPLE_DIMENSION
+        float u1 = rng.next_float();
+        float u2 = rng.next_float();
+        float lobe = rng.next_float();
+        if(lobe < metal) {
+            if(mirror()) {
+                s.direction = reflection(normal, -wo);
+                s.weight = specular_color;
+                s.pdf = 0;
+                return true;
+            }
+            // microfacet normal with density D * cos
+            float tan2 = alpha * alpha * u1 / (1 - u1);
+            float cos_m = 1 / sqrt(1 + tan2);
+            float sin_m = sqrt(fmax(0.0f, 1 - cos_m * cos_m));
+            float phi = 2 * M_PI * u2;
+            Vec3 t = VEC3_ZERO, b = VEC3_ZERO;
+            orthonormal_basis(normal, t, b);
+            Vec3 m = t * (sin_m * cos(phi)) + b * (sin_m * sin(phi)) + normal * cos_m;
+            s.direction = reflection(m, -wo);
+        }
+        else {
+            // cosine weighted, the random direction can be exactly opposite to an axis aligned normal
+            float z = 1 - 2 * u1;
+            float r = sqrt(fmax(0.0f, 1 - z * z));
+            float phi = 2 * M_PI * u2;
+            Vec3 d = normal + Vec3(r * cos(phi), r * sin(phi), z);
+            if(d.squared_length() < 1e-12f) d = normal;
+            s.direction = d.normalize();
+        }
+        s.pdf = pdf(wo, s.direction);
+        if(s.pdf <= 0) return false;
+        s.weight = eval(wo, s.direction) / s.pdf;
+        return true;
+    }
+};
@@ -0,0 +1,205 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "vec3.h"
+#include "constant.h"
+
+// number of bins used when searching for the best split
+const int BVH_BIN_COUNT = 16;
+// leaf never hold more primitives than this
+const int BVH_MAX_LEAF_SIZE = 8;
+// traversal stack size, the builder will not go deeper than this
+const int BVH_MAX_DEPTH = 64;
+
+struct AABB {
+    Vec3 min = Vec3(INFINITY, INFINITY, INFINITY);
+    Vec3 max = -Vec3(INFINITY, INFINITY, INFINITY);
+
+    void grow(const Vec3 &p) {
+        min = Vec3(fmin(min.x, p.x), fmin(min.y, p.y), fmin(min.z, p.z));
+        max = Vec3(fmax(max.x, p.x), fmax(max.y, p.y), fmax(max.z, p.z));
+    }
+    void grow(const AABB &b) {
+        grow(b.min);
+        grow(b.max);
+    }
+    Vec3 centroid() const {
+        return (min + max) * 0.5f;
+    }
+    float surface_area() const {
+        Vec3 e = max - min;
+        if(e.x < 0) return 0;
+        return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+};
+
+// a leaf has count > 0 and left_first point to the first primitive in indices
+// an inner node has count = 0 and its children are at left_first and left_first + 1
+struct BVHNode {
+    Vec3 box_min = VEC3_ZERO;
+    Vec3 box_max = VEC3_ZERO;
+    int left_first = 0;
+    int count = 0;
+};
+
+// bounding volume hierarchy built with the surface area heuristic
+// primitives are only known by their bounding box so it can be used
+// for triangles of a mesh as well as for objects of a scene
+class BVH {
+private:
+    std::vector<AABB> boxes;
+    std::vector<Vec3> centroids;
+    // cost of one primitive test relative to one node visit
+    float intersection_cost = 1;
+
+    AABB node_bounds(int first, int count) {
+        AABB b;
+        for(int i = first; i < first + count; i++)
+            b.grow(boxes[indices[i]]);
+        return b;
+    }
+    void make_leaf(int node_index, int first, int count) {
+        nodes[node_index].left_first = first;
+        nodes[node_index].count = count;
+    }
+    void subdivide(int node_index, int first, int count, int depth) {
+        AABB bounds = node_bounds(first, count);
+        nodes[node_index].box_min = bounds.min;
+        nodes[node_index].box_max = bounds.max;
+
+        if(count <= 1 or depth >= BVH_MAX_DEPTH - 1) {
+            make_leaf(node_index, first, count);
+            return;
+        }
+
+        AABB centroid_bounds;
+        for(int i = first; i < first + count; i++)
+            centroid_bounds.grow(centroids[indices[i]]);
+
+        // binned SAH, find the cheapest split plane on all 3 axis
+        float best_cost = INFINITY;
+        int best_axis = -1;
+        int best_bin = 0;
+        for(int axis = 0; axis < 3; axis++) {
+            float lo = centroid_bounds.min[axis];
+            float hi = centroid_bounds.max[axis];
+            if(hi <= lo) continue;
+            float scale = BVH_BIN_COUNT / (hi - lo);
+
+            AABB bin_box[BVH_BIN_COUNT];
+            int bin_count[BVH_BIN_COUNT] = {0};
+            for(int i = first; i < first + count; i++) {
+                int b = fmin(BVH_BIN_COUNT - 1, (centroids[indices[i]][axis] - lo) * scale);
+                bin_count[b]++;
+                bin_box[b].grow(boxes[indices[i]]);
+            }
+
+            // sweep from both side to get area and count of every split
+            float left_area[BVH_BIN_COUNT - 1];
+            int left_count[BVH_BIN_COUNT - 1];
+            AABB left_box;
+            int left_sum = 0;
+            for(int b = 0; b < BVH_BIN_COUNT - 1; b++) {
+                left_sum += bin_count[b];
+                left_box.grow(bin_box[b]);
+                left_count[b] = left_sum;
+                left_area[b] = left_box.surface_area();
+            }
+            AABB right_box;
+            int right_sum = 0;
+            for(int b = BVH_BIN_COUNT - 1; b > 0; b--) {
+                right_sum += bin_count[b];
+                right_box.grow(bin_box[b]);
+                if(left_count[b - 1] == 0 or right_sum == 0) continue;
+                float cost = left_count[b - 1] * left_area[b - 1] + right_sum * right_box.surface_area();
+                if(cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        // all centroids are at the same spot, nothing to split
+        if(best_axis == -1) {
+            if(count <= BVH_MAX_LEAF_SIZE) {
+                make_leaf(node_index, first, count);
+                return;
+            }
+            // split in the middle to keep leaf size bounded
+            int half = count / 2;
+            int left = nodes.size();
+            nodes.resize(left + 2);
+            nodes[node_index].left_first = left;
+            nodes[node_index].count = 0;
+            subdivide(left, first, half, depth + 1);
+            subdivide(left + 1, first + half, count - half, depth + 1);
+            return;
+        }
+
+        // cost of intersecting everything vs traversing one more level
+        float leaf_cost = count * bounds.surface_area() * intersection_cost;
+        float split_cost = bounds.surface_area() + best_cost * intersection_cost;
+        if(split_cost >= leaf_cost and count <= BVH_MAX_LEAF_SIZE) {
+            make_leaf(node_index, first, count);
+            return;
+        }
+
+        // partition primitive indices by the chosen plane
+        float lo = centroid_bounds.min[best_axis];
+        float scale = BVH_BIN_COUNT / (centroid_bounds.max[best_axis] - lo);
+        int i = first;
+        int j = first + count - 1;
+        while(i <= j) {
+            int b = fmin(BVH_BIN_COUNT - 1, (centroids[indices[i]][best_axis] - lo) * scale);
+            if(b < best_bin) i++;
+            else std::swap(indices[i], indices[j--]);
+        }
+        int left_count = i - first;
+        if(left_count == 0 or left_count == count) left_count = count / 2;
+
+        int left = nodes.size();
+        nodes.resize(left + 2);
+        nodes[node_index].left_first = left;
+        nodes[node_index].count = 0;
+        subdivide(left, first, left_count, depth + 1);
+        subdivide(left + 1, first + left_count, count - left_count, depth + 1);
+    }
+public:
+    std::vector<BVHNode> nodes;
+    std::vector<int> indices;
+
+    // primitives tested several at a time in a leaf should use a lower intersection cost
+    void build(const std::vector<AABB> &primitive_boxes, float primitive_cost = 1) {
+        boxes = primitive_boxes;
+        intersection_cost = primitive_cost;
+        int n = boxes.size();
+
+        nodes.clear();
+        indices.resize(n);
+        centroids.resize(n, VEC3_ZERO);
+        for(int i = 0; i < n; i++) {
+            indices[i] = i;
+            centroids[i] = boxes[i].centroid();
+        }
+        if(n == 0) return;
+
+        nodes.reserve(2 * n);
+        nodes.resize(1);
+        subdivide(0, 0, n, 0);
+
+        // only needed while building
+        std::vector<AABB>().swap(boxes);
+        std::vector<Vec3>().swap(centroids);
+    }
+    bool empty() const {
+        return nodes.empty();
+    }
+    AABB bounds() const {
+        AABB b;
+        if(empty()) return b;
+        b.min = nodes[0].box_min;
+        b.max = nodes[0].box_max;
+        return b;
+    }
+};
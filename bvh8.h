@@ -0,0 +1,188 @@
+#pragma once
+#include <vector>
+#include <stdint.h>
+#include "vec3.h"
+#include "constant.h"
+#include "bvh.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// layout of the mesh BVH walked by the rays, selectable at runtime for benchmarking
+enum BVH_LAYOUT {
+    BVH_BINARY = 0,
+    BVH_WIDE8 = 1,
+};
+int bvh_layout = BVH_WIDE8;
+
+// 8 wide node, child boxes are stored in 8 bits per plane relative to the node box
+// a plane of child i is at origin + q[i] * scale, 112 bytes so 2 cache lines
+struct BVH8Node {
+    float origin[3];
+    float scale[3];
+    uint8_t qmin[3][8];
+    uint8_t qmax[3][8];
+    // inner child: index of the node, leaf child: first primitive in BVH::indices
+    int32_t child[8];
+    // 0 for inner child, number of primitives for leaf child
+    uint8_t count[8];
+};
+// empty child slot
+const int32_t BVH8_EMPTY = -1;
+// a node push at most 8 children and the tree is never deeper than the binary one
+const int BVH8_STACK_SIZE = 8 * BVH_MAX_DEPTH;
+
+// built by collapsing a binary BVH, leaves are the same primitive ranges
+// so primitive data stored in binary BVH order can be reused as is
+class BVH8 {
+private:
+    const BVH* source;
+
+    // children of a binary node collapsed into up to 8 nodes, open the biggest inner one first
+    int collect_children(int node_index, int out[8]) {
+        const std::vector<BVHNode> &bin = source->nodes;
+        int n = 0;
+        out[n++] = bin[node_index].left_first;
+        out[n++] = bin[node_index].left_first + 1;
+        while(n < 8) {
+            int best = -1;
+            float best_area = -1;
+            for(int i = 0; i < n; i++) {
+                const BVHNode &c = bin[out[i]];
+                if(c.count > 0) continue;
+                AABB b;
+                b.min = c.box_min;
+                b.max = c.box_max;
+                if(b.surface_area() > best_area) {
+                    best_area = b.surface_area();
+                    best = i;
+                }
+            }
+            if(best == -1) break;
+            int opened = out[best];
+            out[best] = bin[opened].left_first;
+            out[n++] = bin[opened].left_first + 1;
+        }
+        return n;
+    }
+    void quantize(BVH8Node &node, int slot, const BVHNode &c) {
+        for(int axis = 0; axis < 3; axis++) {
+            float s = node.scale[axis];
+            float cmin = c.box_min[axis];
+            float cmax = c.box_max[axis];
+            int qlo = 0;
+            int qhi = 255;
+            if(s > 0) {
+                qlo = floor((cmin - node.origin[axis]) / s);
+                qhi = ceil((cmax - node.origin[axis]) / s);
+                qlo = qlo < 0 ? 0 : (qlo > 255 ? 255 : qlo);
+                qhi = qhi < 0 ? 0 : (qhi > 255 ? 255 : qhi);
+                // rounding must never shrink the box
+                while(qlo > 0 and node.origin[axis] + qlo * s > cmin) qlo--;
+                while(qhi < 255 and node.origin[axis] + qhi * s < cmax) qhi++;
+            }
+            node.qmin[axis][slot] = qlo;
+            node.qmax[axis][slot] = qhi;
+        }
+    }
+    int build_node(int binary_index) {
+        int node_index = nodes.size();
+        nodes.push_back(BVH8Node());
+
+        const BVHNode &bin = source->nodes[binary_index];
+        Vec3 lo = bin.box_min;
+        Vec3 hi = bin.box_max;
+
+        int children[8];
+        int n = 0;
+        // a root that is a leaf still get a node with one child
+        if(bin.count > 0) children[n++] = binary_index;
+        else n = collect_children(binary_index, children);
+
+        BVH8Node node;
+        for(int axis = 0; axis < 3; axis++) {
+            node.origin[axis] = lo[axis];
+            // slightly bigger so that hi is still reachable after rounding
+            node.scale[axis] = (hi[axis] - lo[axis]) / 255.0f * 1.0001f;
+        }
+        for(int i = 0; i < 8; i++) {
+            node.child[i] = BVH8_EMPTY;
+            node.count[i] = 0;
+            for(int axis = 0; axis < 3; axis++) {
+                node.qmin[axis][i] = 255;
+                node.qmax[axis][i] = 0;
+            }
+        }
+        for(int i = 0; i < n; i++) {
+            const BVHNode &c = source->nodes[children[i]];
+            quantize(node, i, c);
+            if(c.count > 0) {
+                node.child[i] = c.left_first;
+                node.count[i] = c.count > 255 ? 255 : c.count;
+            }
+        }
+        // inner children are built after so the node index is known
+        for(int i = 0; i < n; i++) {
+            const BVHNode &c = source->nodes[children[i]];
+            if(c.count == 0) node.child[i] = build_node(children[i]);
+        }
+        nodes[node_index] = node;
+        return node_index;
+    }
+public:
+    std::vector<BVH8Node> nodes;
+
+    // leaves with more than 255 primitives are not expected,
+    // the binary builder keep them at BVH_MAX_LEAF_SIZE
+    void build(const BVH &bvh) {
+        nodes.clear();
+        if(bvh.empty()) return;
+        source = &bvh;
+        build_node(0);
+        source = nullptr;
+    }
+    bool empty() const {
+        return nodes.empty();
+    }
+    size_t memory_size() const {
+        return nodes.size() * sizeof(BVH8Node);
+    }
+};
+
+// entry distance of the ray in every child of a node, INFINITY if missed or farther than t_max
+inline void intersect_BVH8_children(const BVH8Node &node, const Vec3 &origin, const Vec3 &inv_dir, float t_max, float out[8]) {
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 t_near = _mm256_setzero_ps();
+    __m256 t_far = _mm256_set1_ps(t_max);
+    for(int axis = 0; axis < 3; axis++) {
+        // plane = origin + q * scale, t = (plane - ray origin) * inv_dir = q * a + b
+        float a = node.scale[axis] * inv_dir[axis];
+        float b = (node.origin[axis] - origin[axis]) * inv_dir[axis];
+        __m256 qlo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)node.qmin[axis])));
+        __m256 qhi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)node.qmax[axis])));
+        __m256 t0 = _mm256_fmadd_ps(qlo, _mm256_set1_ps(a), _mm256_set1_ps(b));
+        __m256 t1 = _mm256_fmadd_ps(qhi, _mm256_set1_ps(a), _mm256_set1_ps(b));
+        t_near = _mm256_max_ps(t_near, _mm256_min_ps(t0, t1));
+        t_far = _mm256_min_ps(t_far, _mm256_max_ps(t0, t1));
+    }
+    __m256 hit = _mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ);
+    __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)node.child), _mm256_set1_epi32(BVH8_EMPTY)));
+    hit = _mm256_and_ps(hit, valid);
+    _mm256_storeu_ps(out, _mm256_blendv_ps(_mm256_set1_ps(INFINITY), t_near, hit));
+#else
+    for(int i = 0; i < 8; i++) {
+        float t_near = 0;
+        float t_far = t_max;
+        for(int axis = 0; axis < 3; axis++) {
+            float a = node.scale[axis] * inv_dir[axis];
+            float b = (node.origin[axis] - origin[axis]) * inv_dir[axis];
+            float t0 = node.qmin[axis][i] * a + b;
+            float t1 = node.qmax[axis][i] * a + b;
+            t_near = std::max(t_near, std::min(t0, t1));
+            t_far = std::min(t_far, std::max(t0, t1));
+        }
+        out[i] = node.child[i] != BVH8_EMPTY and t_near <= t_far ? t_near : INFINITY;
+    }
+#endif
+}
@@ -4,11 +4,28 @@
 #include "transformation.h"
 #include "ray.h"
 #include "constant.h"
+#include "sampler.h"
 
+// rays are built from the camera basis, nothing is stored per pixel
+// so turning the camera or changing the resolution cost the same at any size
 class Camera {
 private:
-    std::vector<std::vector<Vec3>> pixel_in_world_BASE;
-    std::vector<std::vector<Vec3>> pixel_in_world;
+    // unit vectors of the camera in world space
+    Vec3 forward = Vec3(0, 0, 1);
+    Vec3 right = Vec3(1, 0, 0);
+    Vec3 up = Vec3(0, 1, 0);
+    // size of the viewport at focal_length in front of the camera
+    float viewport_width = 0;
+    float viewport_height = 0;
+
+    // the camera is panned around the world y axis then tilted around its own right axis
+    void update_basis() {
+        float sp = sin(panned_angle), cp = cos(panned_angle);
+        float st = sin(tilted_angle), ct = cos(tilted_angle);
+        forward = Vec3(sp * ct, st, cp * ct);
+        right = Vec3(cp, 0, -sp);
+        up = Vec3(-sp * st, ct, -cp * st);
+    }
 public:
     Vec3 position = VEC3_ZERO;
 
@@ -24,88 +41,75 @@ public:
 
     int max_ray_bounce_count = 10;
     int ray_per_pixel = 1;
+    // radius of the lens, 0 for a pinhole camera
     float blur_rate = 0.1f;
 
     float max_range = 50.0f;
 
-
-    Camera() {
-        pixel_in_world = std::vector<std::vector<Vec3>>(MAX_WIDTH, v_height);
-        pixel_in_world_BASE = pixel_in_world;
-    }
-
     // create a ray for (x, y) pixel in screen
-    Ray ray(int x, int y) {
-        // defocus effect by offsetting ray origin
-        Vec3 rd = VEC3_ZERO;
-        if(blur_rate != 0.0f)
-            rd = random_direction() * blur_rate;
+    Ray ray(int x, int y, Sampler &rng) {
+        // point of the pixel on the focal plane, always in focus
+        float u = viewport_width * ((x + 0.5f) / WIDTH - 0.5f);
+        float v = viewport_height * (0.5f - (y + 0.5f) / HEIGHT);
+        Vec3 endpoint = position + right * u + up * v + forward * focal_length;
 
-        Vec3 startpoint = position + rd;
-        Vec3 endpoint = position + pixel_in_world[x][y];
+        // thin lens, the origin is a uniform point on the lens disk
+        Vec3 startpoint = position;
+        if(blur_rate != 0.0f) {
+            float r = blur_rate * sqrt(rng.next_float());
+            float phi = 2 * M_PI * rng.next_float();
+            startpoint += right * (r * cos(phi)) + up * (r * sin(phi));
+        }
 
-        Vec3 direction = (endpoint - startpoint).normalize();
         Ray new_ray;
-        new_ray.direction = direction;
+        new_ray.direction = (endpoint - startpoint).normalize();
         new_ray.origin = startpoint;
         new_ray.max_range = max_range;
 
         return new_ray;
     }
-    // store viewport pixels position for camera rotation
-    // this is the position if camera looking direction is (0, 0, 1)
+    // pixel coordinates where point is seen through the lens centre, false if it is behind the camera
+    bool project(Vec3 point, float &x, float &y) const {
+        Vec3 d = point - position;
+        float z = d.dot(forward);
+        if(z <= 0) return false;
+        float u = d.dot(right) * focal_length / z;
+        float v = d.dot(up) * focal_length / z;
+        x = (u / viewport_width + 0.5f) * WIDTH - 0.5f;
+        y = (0.5f - v / viewport_height) * HEIGHT - 0.5f;
+        return true;
+    }
+    // call after FOV, focal_length, WIDTH or HEIGHT changed
     void init() {
-        float viewport_width = 2 * focal_length * tan(deg2rad(FOV/2));
-        float viewport_height = viewport_width * HEIGHT/(float)WIDTH;
-
-        for(int x = 0; x < WIDTH; x++)
-            for(int y = 0; y < HEIGHT; y++) {
-                float _w = viewport_width * (0.5f - (x - 0.5f)/WIDTH);
-                float _h = viewport_height * (0.5f - (y - 0.5f)/HEIGHT);
-
-                pixel_in_world[x][y] = Vec3(-_w, _h, focal_length);
-                pixel_in_world_BASE[x][y] = pixel_in_world[x][y];
-            }
+        viewport_width = 2 * focal_length * tan(deg2rad(FOV/2));
+        viewport_height = viewport_width * HEIGHT/(float)WIDTH;
+        update_basis();
     }
     void reset_rotation() {
         panned_angle = 0;
         tilted_angle = 0;
-        pixel_in_world = pixel_in_world_BASE;
+        update_basis();
     }
 
     void tilt(float a) {
         // clamp tilted_angle to [-max_tilt, max_tilt]
-        float old_tilted_angle = tilted_angle;
         tilted_angle += a;
         float rad_max_tilt = deg2rad(max_tilt);
         tilted_angle = fmax(tilted_angle, -rad_max_tilt);
         tilted_angle = fmin(tilted_angle, rad_max_tilt);
-        a = tilted_angle - old_tilted_angle;
-
-        // perpendicular vector of looking dir for rotation
-        Vec3 dir = get_looking_direction().cross({0, 1, 0});
-        for(int x = 0; x < WIDTH; x++)
-            for(int y = 0; y < HEIGHT; y++)
-                pixel_in_world[x][y] = _rotate_on_axis(pixel_in_world[x][y], dir, a);
+        update_basis();
     }
     void pan(float a) {
         panned_angle += a;
-        for(int x = 0; x < WIDTH; x++)
-            for(int y = 0; y < HEIGHT; y++)
-                pixel_in_world[x][y] = _rotate_y(pixel_in_world[x][y], a);
+        update_basis();
     }
     void move_foward(float ammount) {
-        Vec3 dir = get_looking_direction();
-        dir *= ammount;
-        position += dir;
+        position += forward * ammount;
     }
     void move_left(float ammount) {
-        Vec3 dir = get_looking_direction();
-        std::swap(dir.x, dir.z); dir.y = 0; dir.x *= -1;
-        dir *= ammount;
-        position += dir;
+        position += right * -ammount;
     }
     Vec3 get_looking_direction() {
-        return Vec3(sin(panned_angle), sin(tilted_angle), cos(panned_angle));
+        return forward;
     }
 };
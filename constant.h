@@ -1,15 +1,9 @@
 #pragma once
-#include <vector>
 #include "vec3.h"
 
 const int MAX_WIDTH = 2000;
 const int MAX_HEIGHT = 2000;
 
-// how many threads in a row
-const int row_threads = 2;
-// how many threads in a column
-const int column_threads = 2;
-
 const Vec3 BLACK(0, 0, 0);
 const Vec3 WHITE(1, 1, 1);
 const Vec3 RED(1, 0, 0);
@@ -26,5 +20,3 @@ const float RI_WATER = 1.333f;
 const float RI_GLASS = 1.52f;
 const float RI_FLINT_GLASS = 1.66f;
 const float RI_DIAMOND = 2.4f;
-
-const std::vector<Vec3> v_height(MAX_HEIGHT, VEC3_ZERO);
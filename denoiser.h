@@ -0,0 +1,185 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include "vec3.h"
+#include "helper.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+// edge avoiding a-trous wavelet filter in the spirit of SVGF
+// the color is divided by the albedo so textures stay sharp, filtered as irradiance and multiplied back
+// every pass blur with a 5x5 B3 spline kernel whose taps are spread twice as far as the pass before,
+// a tap weight drop when its luminance is far from the centre compared to the noise of the centre
+// or when its normal or depth differ
+// off by default, the shown image is then the plain accumulated estimate
+bool denoise = false;
+int denoise_iterations = 5;
+// larger let through luminance differences of more standard deviations
+float denoise_strength = 4.0f;
+// set by the editor when a setting above changed, so a finished image is filtered again
+std::atomic<bool> denoise_changed(false);
+
+// below this many samples the noise of a pixel is estimated from its neighbours in a 7x7 window
+const int DENOISE_MIN_SAMPLES = 4;
+// depth may change by this fraction of the centre depth per pixel of tap distance
+const float DENOISE_DEPTH_SIGMA = 0.05f;
+const float DENOISE_MIN_ALBEDO = 1e-3f;
+
+class Denoiser {
+private:
+    int w = 0;
+    int h = 0;
+    // irradiance and variance of its luminance, ping pong between passes
+    std::vector<Vec3> irradiance[2];
+    std::vector<float> variance[2];
+    // unit first hit normals, zero where nothing was hit
+    std::vector<Vec3> normals;
+    double last_time = 0;
+
+    static Vec3 safe_albedo(Vec3 albedo) {
+        return Vec3(fmax(albedo.x, DENOISE_MIN_ALBEDO), fmax(albedo.y, DENOISE_MIN_ALBEDO), fmax(albedo.z, DENOISE_MIN_ALBEDO));
+    }
+    void prepare_row(const Framebuffer &frame, int y) {
+        for(int x = 0; x < w; x++) {
+            int i = y * w + x;
+            const Pixel &p = frame.at(x, y);
+            const SurfaceSample &s = frame.surface(x, y);
+            Vec3 albedo = safe_albedo(s.albedo);
+            irradiance[0][i] = p.color() / albedo;
+            // variance of the mean luminance, scaled like the irradiance
+            float mean = luminance(p.color());
+            float v = p.samples > 1 ? fmax(0.0f, p.luminance_moment - mean * mean) / (p.samples - 1) : 0;
+            float a = luminance(albedo);
+            variance[1][i] = v / (a * a);
+            Vec3 n = s.normal;
+            normals[i] = n.squared_length() > 1e-6f ? n.normalize() : VEC3_ZERO;
+        }
+    }
+
+    // a few samples say nothing about the noise, use the spread of the pixels around on the same surface
+    void estimate_variance_row(const Framebuffer &frame, int y) {
+        for(int x = 0; x < w; x++) {
+            int i = y * w + x;
+            Vec3 normal = normals[i];
+            if(frame.at(x, y).samples >= DENOISE_MIN_SAMPLES or normal == VEC3_ZERO) {
+                variance[0][i] = variance[1][i];
+                continue;
+            }
+            float sum = 0;
+            float square_sum = 0;
+            float weight_sum = 0;
+            for(int qy = std::max(y - 3, 0); qy <= std::min(y + 3, h - 1); qy++)
+                for(int qx = std::max(x - 3, 0); qx <= std::min(x + 3, w - 1); qx++) {
+                    int j = qy * w + qx;
+                    if(normal.dot(normals[j]) < 0.9f) continue;
+                    float l = luminance(irradiance[0][j]);
+                    sum += l;
+                    square_sum += l * l;
+                    weight_sum += 1;
+                }
+            float mean = sum / weight_sum;
+            variance[0][i] = fmax(0.0f, square_sum / weight_sum - mean * mean);
+        }
+    }
+    // variance of pixel i blurred by a 3x3 gaussian, less noisy to compare luminance against
+    float blurred_variance(int x, int y, int from) const {
+        static const float kernel[2] = {1.0f / 2, 1.0f / 4};
+        float sum = 0;
+        float weight_sum = 0;
+        for(int qy = std::max(y - 1, 0); qy <= std::min(y + 1, h - 1); qy++)
+            for(int qx = std::max(x - 1, 0); qx <= std::min(x + 1, w - 1); qx++) {
+                float weight = kernel[qy != y] * kernel[qx != x];
+                sum += weight * variance[from][qy * w + qx];
+                weight_sum += weight;
+            }
+        return sum / weight_sum;
+    }
+    // one pass on row y, taps step pixels apart
+    void filter_row(const Framebuffer &frame, int y, int step, int from, int to) {
+        static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+        for(int x = 0; x < w; x++) {
+            int i = y * w + x;
+            Vec3 normal = normals[i];
+            float depth = frame.surface(x, y).depth;
+            Vec3 c = irradiance[from][i];
+            // nothing hit, the sky is not noisy
+            if(normal == VEC3_ZERO) {
+                irradiance[to][i] = c;
+                variance[to][i] = variance[from][i];
+                continue;
+            }
+            float l = luminance(c);
+            float l_scale = 1 / (denoise_strength * sqrt(blurred_variance(x, y, from)) + 1e-4f);
+            float z_scale = 1 / (DENOISE_DEPTH_SIGMA * depth * step + 1e-4f);
+
+            Vec3 sum = VEC3_ZERO;
+            float weight_sum = 0;
+            float variance_sum = 0;
+            for(int dy = -2; dy <= 2; dy++) {
+                int qy = y + dy * step;
+                if(qy < 0 or qy >= h) continue;
+                for(int dx = -2; dx <= 2; dx++) {
+                    int qx = x + dx * step;
+                    if(qx < 0 or qx >= w) continue;
+                    int j = qy * w + qx;
+                    float n = fmax(0.0f, normal.dot(normals[j]));
+                    // n^128 by squaring
+                    for(int k = 0; k < 7; k++) n *= n;
+                    if(n <= 0) continue;
+                    Vec3 cq = irradiance[from][j];
+                    float e = fabs(luminance(cq) - l) * l_scale + fabs(frame.surface(qx, qy).depth - depth) * z_scale;
+                    float weight = kernel[dx + 2] * kernel[dy + 2] * n * exp(-e);
+                    sum += cq * weight;
+                    weight_sum += weight;
+                    variance_sum += weight * weight * variance[from][j];
+                }
+            }
+            // the centre tap always has a weight
+            irradiance[to][i] = sum / weight_sum;
+            variance[to][i] = variance_sum / (weight_sum * weight_sum);
+        }
+    }
+public:
+    // filter the accumulated color of frame into its shown color
+    void apply(Framebuffer &frame, ThreadPool &pool) {
+        auto start = std::chrono::steady_clock::now();
+        w = frame.width();
+        h = frame.height();
+        for(int k = 0; k < 2; k++) {
+            irradiance[k].resize(w * h, VEC3_ZERO);
+            variance[k].resize(w * h, 0);
+        }
+        normals.resize(w * h, VEC3_ZERO);
+        pool.run(h, [&](int y, int worker) {
+            prepare_row(frame, y);
+        });
+        pool.run(h, [&](int y, int worker) {
+            estimate_variance_row(frame, y);
+        });
+
+        int from = 0;
+        for(int pass = 0; pass < denoise_iterations; pass++) {
+            int step = 1 << pass;
+            pool.run(h, [&, step, from](int y, int worker) {
+                filter_row(frame, y, step, from, 1 - from);
+            });
+            from = 1 - from;
+        }
+
+        pool.run(h, [&, from](int y, int worker) {
+            for(int x = 0; x < w; x++)
+                frame.set_shown_color(x, y, irradiance[from][y * w + x] * safe_albedo(frame.surface(x, y).albedo));
+        });
+        frame.set_filtered(true);
+        last_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    // time of the last apply in milliseconds
+    double time() const {
+        return last_time;
+    }
+};
+
+// filter of the frames published by the draw thread
+Denoiser denoiser;
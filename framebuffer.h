@@ -0,0 +1,177 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <new>
+#include "vec3.h"
+#include "helper.h"
+
+// accumulated color of a pixel, how many samples it holds and the mean of their squared luminance, 32 bytes
+struct alignas(16) Pixel {
+    float r = 0;
+    float g = 0;
+    float b = 0;
+    float samples = 0;
+    float luminance_moment = 0;
+
+    Vec3 color() const {
+        return Vec3(r, g, b);
+    }
+    void set(Vec3 c, float sample_count, float moment) {
+        r = c.x;
+        g = c.y;
+        b = c.z;
+        samples = sample_count;
+        luminance_moment = moment;
+    }
+    // standard error of the mean luminance over the mean luminance
+    // dark pixels are measured against floor so they do not stay noisy forever
+    float relative_error(float floor) const {
+        if(samples < 2) return INFINITY;
+        float mean = luminance(color());
+        float variance = fmax(0.0f, luminance_moment - mean * mean) * samples / (samples - 1);
+        return sqrt(variance / samples) / (mean + floor);
+    }
+};
+
+// first surface hit by the paths of a pixel, averaged over the samples like the color
+// the denoiser use it to find edges and the reprojection to follow surfaces, a path that hit nothing has a zero normal
+struct SurfaceSample {
+    Vec3 albedo = VEC3_ZERO;
+    Vec3 normal = VEC3_ZERO;
+    // world space
+    Vec3 position = VEC3_ZERO;
+    float depth = 0;
+
+    void blend(const SurfaceSample &s, float w) {
+        albedo = albedo * (1 - w) + s.albedo * w;
+        normal = normal * (1 - w) + s.normal * w;
+        position = position * (1 - w) + s.position * w;
+        depth = depth * (1 - w) + s.depth * w;
+    }
+};
+
+// image of the viewport size in one row major allocation
+// it hold three planes one after the other: accumulated pixels, surfaces and shown colors
+// the accumulated color is kept apart from the shown one so a filtered image never feed the accumulation
+class Framebuffer {
+private:
+    // unit of the allocation, every plane start on a multiple of it so a Pixel is aligned
+    struct alignas(16) Block {
+        float f[4];
+    };
+    int w = 0;
+    int h = 0;
+    std::vector<Block> storage;
+    // start of the surface and shown planes, in blocks
+    size_t surface_offset = 0;
+    size_t shown_offset = 0;
+    bool filtered = false;
+
+    static size_t blocks(size_t bytes) {
+        return (bytes + sizeof(Block) - 1) / sizeof(Block);
+    }
+    Pixel* pixels() {
+        return reinterpret_cast<Pixel*>(storage.data());
+    }
+    const Pixel* pixels() const {
+        return reinterpret_cast<const Pixel*>(storage.data());
+    }
+    SurfaceSample* surfaces() {
+        return reinterpret_cast<SurfaceSample*>(storage.data() + surface_offset);
+    }
+    const SurfaceSample* surfaces() const {
+        return reinterpret_cast<const SurfaceSample*>(storage.data() + surface_offset);
+    }
+    Vec3* shown() {
+        return reinterpret_cast<Vec3*>(storage.data() + shown_offset);
+    }
+    const Vec3* shown() const {
+        return reinterpret_cast<const Vec3*>(storage.data() + shown_offset);
+    }
+    // place the planes of a width x height image in storage and clear them
+    void layout(int width, int height, bool shrink) {
+        w = width;
+        h = height;
+        size_t n = (size_t)w * h;
+        surface_offset = blocks(n * sizeof(Pixel));
+        shown_offset = surface_offset + blocks(n * sizeof(SurfaceSample));
+        size_t total = shown_offset + blocks(n * sizeof(Vec3));
+        if(shrink) std::vector<Block>(total).swap(storage);
+        else storage.resize(total);
+        Pixel* p = pixels();
+        SurfaceSample* s = surfaces();
+        Vec3* c = shown();
+        for(size_t i = 0; i < n; i++) {
+            new (&p[i]) Pixel();
+            new (&s[i]) SurfaceSample();
+            new (&c[i]) Vec3(VEC3_ZERO);
+        }
+        filtered = false;
+    }
+public:
+    Framebuffer() = default;
+    // frames are big, only move them around
+    Framebuffer(const Framebuffer&) = delete;
+    Framebuffer& operator=(const Framebuffer&) = delete;
+
+    // content is cleared, memory of a bigger previous size is given back
+    void resize(int width, int height) {
+        layout(width, height, true);
+    }
+    // content is cleared, the allocation is kept so the render scale can change every frame without allocating
+    void reshape(int width, int height) {
+        layout(width, height, false);
+    }
+    int width() const {
+        return w;
+    }
+    int height() const {
+        return h;
+    }
+    bool same_size(const Framebuffer &other) const {
+        return w == other.w and h == other.h;
+    }
+    Pixel& at(int x, int y) {
+        return pixels()[y * w + x];
+    }
+    const Pixel& at(int x, int y) const {
+        return pixels()[y * w + x];
+    }
+    Vec3 color(int x, int y) const {
+        return at(x, y).color();
+    }
+    SurfaceSample& surface(int x, int y) {
+        return surfaces()[y * w + x];
+    }
+    const SurfaceSample& surface(int x, int y) const {
+        return surfaces()[y * w + x];
+    }
+
+    // color to display, the filtered one when set_filtered(true) was called after writing it
+    Vec3 shown_color(int x, int y) const {
+        return filtered ? shown()[y * w + x] : color(x, y);
+    }
+    // shown color at a point in pixels of this frame, bilinear between the 4 pixels around, to display it at another size
+    Vec3 sample_shown_color(float x, float y) const {
+        x = fmin(fmax(x, 0.0f), w - 1.0f);
+        y = fmin(fmax(y, 0.0f), h - 1.0f);
+        int x0 = std::max(0, std::min((int)x, w - 2));
+        int y0 = std::max(0, std::min((int)y, h - 2));
+        int x1 = std::min(x0 + 1, w - 1);
+        int y1 = std::min(y0 + 1, h - 1);
+        float fx = x - x0;
+        float fy = y - y0;
+        Vec3 top = shown_color(x0, y0) * (1 - fx) + shown_color(x1, y0) * fx;
+        Vec3 bottom = shown_color(x0, y1) * (1 - fx) + shown_color(x1, y1) * fx;
+        return top * (1 - fy) + bottom * fy;
+    }
+    void set_shown_color(int x, int y, Vec3 c) {
+        shown()[y * w + x] = c;
+    }
+    void set_filtered(bool f) {
+        filtered = f;
+    }
+    size_t memory_size() const {
+        return storage.size() * sizeof(Block);
+    }
+};
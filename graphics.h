@@ -5,6 +5,12 @@
 #include "objects.h"
 #include "camera.h"
 #include "transformation.h"
+#include "sphere_grid.h"
+#include "thread_pool.h"
+#include "framebuffer.h"
+#include "lights.h"
+#include "denoiser.h"
+#include "reprojection.h"
 
 #include "imgui/imgui.h"
 #include "imgui/backends/imgui_impl_sdl2.h"
@@ -45,6 +51,10 @@ private:
     bool transparent = false;
     float refractive_index = 0;
     const char* refractive_index_items[6] = {"air", "water", "glass", "flint glass", "diamond", "self-define"};
+    const char* triangle_kernel_items[3] = {"scalar", "SSE (4 wide)", "AVX2 (8 wide)"};
+    const char* bvh_layout_items[2] = {"binary", "8 wide quantized"};
+    const char* sphere_acceleration_items[2] = {"scene BVH", "uniform grid"};
+    const char* sampler_items[3] = {"random", "sobol", "blue noise"};
     int refractive_index_current_item = 1;
     bool smoke = false;
     float density = 1.0f;
@@ -99,12 +109,14 @@ public:
         disable_drawing();
         texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
     }
-    void save_image(std::vector<std::vector<Vec3>>* screen_color, int tonemapping_method, float gamma) {
-        unsigned char data[WIDTH * HEIGHT * 3];
-
-        for(int x = 0; x < WIDTH; x++)
-            for(int y = 0; y < HEIGHT; y++) {
-                Vec3 color = (*screen_color)[x][y];
+    void save_image(const Framebuffer* screen_color, int tonemapping_method, float gamma) {
+        int width = screen_color->width();
+        int height = screen_color->height();
+        std::vector<unsigned char> data(width * height * 3);
+
+        for(int y = 0; y < height; y++)
+            for(int x = 0; x < width; x++) {
+                Vec3 color = screen_color->shown_color(x, y);
                 color = tonemap(color, RGB_CLAMPING);
                 color = gamma_correct(color, gamma);
                 color *= 255;
@@ -113,9 +125,9 @@ public:
                 int g = int(color.y);
                 int b = int(color.z);
 
-                data[(y * WIDTH + x) * 3 + 0] = r;
-                data[(y * WIDTH + x) * 3 + 1] = g;
-                data[(y * WIDTH + x) * 3 + 2] = b;
+                data[(y * width + x) * 3 + 0] = r;
+                data[(y * width + x) * 3 + 1] = g;
+                data[(y * width + x) * 3 + 2] = b;
             }     
         auto t = std::time(nullptr);
         auto tm = *std::localtime(&t);
@@ -126,17 +138,18 @@ public:
         str = "res/" + oss.str() + ".png";
         char *c = const_cast<char*>(str.c_str());
 
-        stbi_write_png(c, WIDTH, HEIGHT, 3, data, WIDTH * 3);
+        stbi_write_png(c, width, height, 3, data.data(), width * 3);
     }
     void process_gui_event() {
         ImGui_ImplSDL2_ProcessEvent(&event);
     }
-    void gui(std::vector<std::vector<Vec3>>* screen,
-             bool* lazy_ray_trace, int* frame_count, int* frame_num, double delay,
+    void gui(const Framebuffer* screen,
+             bool* lazy_ray_trace, int* frame_count, int* frame_num, float* noise_threshold, int noisy_pixels, double delay, double rays_per_second, double restart_latency,
+             bool* dynamic_resolution, float* target_frame_time, float render_scale,
              int* width, int* height,
              std::vector<Object*>* oc, Object* selecting_object,
              bool* make_sphere_request, bool* make_mesh_request, std::string* request_mesh_name,
-             void (*remove_object_func)(Object*),
+             void (*remove_object_func)(Object*), void (*restart_render_func)(),
              Camera* camera,
              Vec3* up_sky_c, Vec3* down_sky_c,
              bool* running) {
@@ -145,11 +158,18 @@ public:
         ImGui::NewFrame();
 
         // copy all pixel to renderer
+        // a frame drawn at a lower render scale, or left from before a resize, is stretched to the texture
         enable_drawing();
-        for(int x = 0; x < WIDTH; x++)
-            for(int y = 0; y < HEIGHT; y++) {
+        bool stretched = screen->width() != WIDTH or screen->height() != HEIGHT;
+        float scale_x = screen->width() / (float)WIDTH;
+        float scale_y = screen->height() / (float)HEIGHT;
+        // nothing was published yet
+        int draw_height = screen->width() > 0 ? HEIGHT : 0;
+        for(int y = 0; y < draw_height; y++)
+            for(int x = 0; x < WIDTH; x++) {
+                Vec3 color = stretched ? screen->sample_shown_color((x + 0.5f) * scale_x - 0.5f, (y + 0.5f) * scale_y - 0.5f) : screen->shown_color(x, y);
                 // post processing
-                Vec3 COLOR = tonemap((*screen)[x][y], RGB_CLAMPING);
+                Vec3 COLOR = tonemap(color, RGB_CLAMPING);
                 COLOR = gamma_correct(COLOR, gamma);
 
                 draw_pixel(x, y, COLOR);
@@ -158,13 +178,43 @@ public:
         
         if(ImGui::CollapsingHeader("Editor")) {
             std::string info = "done rendering";
-            if(*frame_num + 1 < *frame_count)
+            bool converged = *noise_threshold > 0 and *frame_num > 0 and noisy_pixels == 0;
+            if(*frame_num + 1 < *frame_count and !converged)
                 info = "rendering frame " + std::to_string(*frame_num + 1) + '/' + std::to_string(*frame_count);
+            if(*noise_threshold > 0 and !converged)
+                info += ", " + std::to_string(noisy_pixels) + " noisy pixels";
 
             std::string delay_text = "last frame delay " + std::to_string(delay) + "ms";
 
             ImGui::Text("%s", info.c_str());
             ImGui::Text("%s", delay_text.c_str());
+            ImGui::Text("%.2f Mrays/s", rays_per_second / 1e6);
+            ImGui::Text("change to new frame %.1f ms", restart_latency);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("time from the last camera or scene change to the first frame shown after it");
+
+            int thread_count = render_thread_count;
+            ImGui::InputInt("render threads", &thread_count, 1);
+            thread_count = fmin(thread_count, 256);
+            thread_count = fmax(thread_count, 1);
+            render_thread_count = thread_count;
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("%d hardware threads", ThreadPool::default_size());
+            ThreadPool::Stats pool_stats = render_pool.stats();
+            ImGui::Text("%d workers, %.0f%% busy", pool_stats.workers, pool_stats.utilization * 100);
+            // busy time of every worker in the last frame, bars should be about the same height
+            std::vector<float> &busy_times = pool_stats.busy_ms;
+            float busy_min = INFINITY, busy_max = 0;
+            int steals = 0;
+            for(int i = 0; i < pool_stats.workers; i++) {
+                busy_min = fmin(busy_min, busy_times[i]);
+                busy_max = fmax(busy_max, busy_times[i]);
+                steals += pool_stats.steals[i];
+            }
+            if(!busy_times.empty()) {
+                std::string busy_text = "busy " + std::to_string((int)busy_min) + "-" + std::to_string((int)busy_max) + "ms, " + std::to_string(steals) + " steals";
+                ImGui::PlotHistogram("worker busy time", busy_times.data(), busy_times.size(), 0, busy_text.c_str(), 0.0f);
+            }
 
             ImGui::InputInt("viewport width", width, 1);
             *width = fmin(*width, MAX_WIDTH);
@@ -174,9 +224,69 @@ public:
             *height = fmin(*height, MAX_HEIGHT);
             *height = fmax(*height, 2);
 
+            ImGui::Checkbox("dynamic resolution", dynamic_resolution);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("draw at a lower resolution while the camera or an object move\nfull resolution come back once everything is still");
+            if(*dynamic_resolution) {
+                ImGui::DragFloat("target frame time", target_frame_time, 1.0f, 5.0f, 500.0f, "%.0f ms", ImGuiSliderFlags_AlwaysClamp);
+                ImGui::Text("moving render scale %.0f%%", render_scale * 100);
+            }
+
             ImGui::Checkbox("lazy ray tracing", lazy_ray_trace);
             if(ImGui::IsItemHovered())
-                ImGui::SetTooltip("increase performance but decrease image quality");
+                ImGui::SetTooltip("increase performance but decrease image quality\noff while the noise threshold is above 0");
+
+            bool denoise_edited = ImGui::Checkbox("denoise", &denoise);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("edge aware filter of the shown image, the accumulation is not changed");
+            if(denoise) {
+                denoise_edited |= ImGui::SliderInt("denoise passes", &denoise_iterations, 1, 5);
+                denoise_edited |= ImGui::DragFloat("denoise strength", &denoise_strength, 0.1f, 0.1f, 50.0f, "%.1f", ImGuiSliderFlags_AlwaysClamp);
+                if(ImGui::IsItemHovered())
+                    ImGui::SetTooltip("higher blur across larger color differences");
+                ImGui::Text("denoise %.1f ms", denoiser.time());
+            }
+            if(denoise_edited)
+                denoise_changed = true;
+
+            ImGui::Checkbox("temporal reprojection", &temporal_reprojection);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("keep the samples of surfaces still in view when the camera move");
+            if(temporal_reprojection)
+                ImGui::Text("kept %.0f%% of the surfaces when moving", reprojector.kept_fraction() * 100);
+
+            if(ImGui::Checkbox("sample lights", &sample_lights))
+                restart_render_func();
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("aim a ray at an emitter at every diffuse bounce\nsmall lights converge much faster");
+            if(ImGui::Combo("sampler", &sampler_type, sampler_items, 3))
+                restart_render_func();
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("sobol converge faster than random numbers\nblue noise spread the error of the first samples evenly on the screen");
+
+            int kernel = triangle_kernel;
+            ImGui::Combo("triangle kernel", &kernel, triangle_kernel_items, 3);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("ray-triangle intersection routine\nonly the ones enabled at compile time can be selected");
+            if(triangle_kernel_available(kernel))
+                triangle_kernel = kernel;
+
+            ImGui::Combo("sphere acceleration", &sphere_acceleration, sphere_acceleration_items, 2);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("uniform grid is faster to update for a lot of small spheres");
+            ImGui::Combo("mesh BVH", &bvh_layout, bvh_layout_items, 2);
+            size_t triangle_count = 0;
+            size_t bvh_bytes = 0;
+            for(auto &entry: mesh_cache) {
+                const MeshData &geometry = *entry.second;
+                triangle_count += geometry.triangle_count();
+                if(bvh_layout == BVH_WIDE8)
+                    bvh_bytes += geometry.bvh8.memory_size();
+                else
+                    bvh_bytes += geometry.bvh.nodes.size() * sizeof(BVHNode);
+            }
+            if(triangle_count > 0)
+                ImGui::Text("mesh BVH memory %.1f bytes/triangle", bvh_bytes / (float)triangle_count);
 
             ImGui::Checkbox("show crosshair", &show_crosshair);
 
@@ -200,19 +310,12 @@ public:
                 // get perpendicular vector of camera looking dir
                 Vec3 rotating_axis = look_dir.cross({0, 1, 0}).normalize();
 
-                focal_plane->tris = focal_plane->default_tris;
-                for(int i = 0; i < (int)focal_plane->tris.size(); i++) {
-                    for(int j = 0; j < 3; j++) {
-                        Vec3* pos = &(focal_plane->tris[i].vert[j]);
-                        *pos = _scale(*pos, {1e3, 0, 1e3});
-                        *pos = _rotate_y(*pos, camera->panned_angle); // panned angle
-                        *pos = _rotate_on_axis(*pos, rotating_axis, camera->tilted_angle + M_PI / 2); // tilted angle
-                        *pos = *pos + new_pos;
-                    }
-                    focal_plane->tris[i].material = mat;
-                }
-                // calculate AABB for rendering
-                focal_plane->calculate_AABB();
+                // the plane model is flat on y so scaling y does nothing
+                focal_plane->set_transform(Transform::translation(new_pos)
+                                           * Transform::rotation_on_axis(rotating_axis, camera->tilted_angle + M_PI / 2) // tilted angle
+                                           * Transform::rotation_y(camera->panned_angle) // panned angle
+                                           * Transform::scaling({1e3, 1, 1e3}));
+                focal_plane->set_material(mat);
             }
             else if(focal_plane != nullptr) {
                 // hide the focal plane object
@@ -220,7 +323,7 @@ public:
             }
             // force render if clicked
             if(old_show_focal_plane != show_focal_plane)
-                *frame_num = 0;
+                restart_render_func();
 
             ImGui::ColorEdit3("up sky color", up_sky_color);
             Vec3 ukc = Vec3(up_sky_color[0], up_sky_color[1], up_sky_color[2]);
@@ -235,9 +338,16 @@ public:
             ImGui::InputInt("frame count", frame_count, 1);
             if(ImGui::IsItemHovered())
                 ImGui::SetTooltip("number of frame will be rendered");
+            bool was_adaptive = *noise_threshold > 0;
+            ImGui::DragFloat("noise threshold", noise_threshold, 0.001f, 0.0f, 1.0f, "%.3f", ImGuiSliderFlags_AlwaysClamp);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("stop sampling a pixel once its relative error is below this\nrendering end early when every pixel is there, 0 to sample every pixel");
+            // pixels interpolated by lazy ray tracing have a made up error, start again with all of them traced
+            if(!was_adaptive and *noise_threshold > 0 and *lazy_ray_trace)
+                restart_render_func();
 
             if(ImGui::Button("render"))
-                *frame_num = 0;
+                restart_render_func();
             ImGui::SameLine();
             if(ImGui::Button("stop render"))
                 *frame_num = *frame_count;
@@ -465,12 +575,12 @@ public:
                 mat.density = density;
                 obj->set_material(mat);
                 obj->calculate_AABB();
-                *frame_num = 0;
+                restart_render_func();
             }
             if(ImGui::Button("delete object")) {
                 remove_object_func(selecting_object);
                 selecting_object = nullptr;
-                *frame_num = 0;
+                restart_render_func();
             }
         }
         ImGui::End();
@@ -3,6 +3,9 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <map>
+#include <memory>
+#include <stdint.h>
 #include "vec3.h"
 #include "constant.h"
 #include "objects.h"
@@ -33,6 +36,7 @@ inline Vec3 gamma_correct(Vec3 color, float t) {
     return Vec3(pow(color.x, t), pow(color.y, t), pow(color.z, t));
 }
 
+// global generator for scene setup only, it is not safe to use from the render workers
 std::mt19937 RNG;
 std::normal_distribution<float> normal_dist(0, 1);  // N(mean, stddeviation)
 std::uniform_real_distribution<float> dist(0.0, 1.0);
@@ -46,17 +50,51 @@ inline float random_val() {
 inline float random_val_normal_distribution() {
     return normal_dist(RNG);
 }
-inline Vec3 random_direction() {
-    float x = random_val_normal_distribution();
-    float y = random_val_normal_distribution();
-    float z = random_val_normal_distribution();
-    return Vec3(x, y, z).normalize();
+// one round of the PCG output permutation on a LCG step
+inline uint32_t pcg_hash(uint32_t v) {
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
 }
+// counter based random numbers used while rendering
+// every value is a hash of (pixel, sample, bounce, counter), no state is shared between threads
+// so a frame is the same whatever the thread count or the order tiles are drawn
+class RandomStream {
+private:
+    uint32_t key;
+    uint32_t bounce_key;
+    uint32_t counter = 0;
+public:
+    RandomStream(uint32_t pixel, uint32_t sample) {
+        key = pcg_hash(pixel ^ pcg_hash(sample));
+        set_bounce(0);
+    }
+    // numbers of a bounce do not depend on how many the previous bounces used
+    void set_bounce(uint32_t bounce) {
+        bounce_key = pcg_hash(key ^ pcg_hash(bounce));
+        counter = 0;
+    }
+    uint32_t next_uint() {
+        return pcg_hash(bounce_key ^ pcg_hash(counter++));
+    }
+    // in [0, 1), 24 bits so the float is exact
+    float next_float() {
+        return (next_uint() >> 8) * (1.0f / 16777216.0f);
+    }
+};
 
-inline Vec3 random_direction_in_hemisphere(Vec3 n) {
-    Vec3 v = random_direction();
-    if(n.dot(v) < 0) v = -v;
-    return v;
+inline float random_val(RandomStream &rng) {
+    return rng.next_float();
+}
+// t and b complete the unit vector n into an orthonormal basis
+inline void orthonormal_basis(Vec3 n, Vec3 &t, Vec3 &b) {
+    Vec3 a = fabs(n.x) > 0.9f ? Vec3(0, 1, 0) : Vec3(1, 0, 0);
+    t = n.cross(a).normalize();
+    b = n.cross(t);
+}
+// perceived brightness of a linear color
+inline float luminance(Vec3 c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
 }
 inline Vec3 lerp(const Vec3 u, const Vec3 v, const float t) {
     return u * (1-t) + v * t;
@@ -79,38 +117,85 @@ inline float reflectance(float cosine, float ri) {
     return r0 + (1-r0) * pow((1 - cosine),5);
 }
 
-inline Mesh load_mesh_from(std::string sFilename) {
-    Mesh out;
+// geometry already loaded, meshes from the same file share it
+std::map<std::string, std::shared_ptr<const MeshData>> mesh_cache;
+
+inline std::shared_ptr<const MeshData> load_mesh_data(std::string sFilename) {
+    auto cached = mesh_cache.find(sFilename);
+    if(cached != mesh_cache.end()) return cached->second;
+
+    std::shared_ptr<MeshData> data = std::make_shared<MeshData>();
     std::ifstream f(sFilename);
     if (!f.is_open()) {
         std::cout << "failed to load file\n";
-        return out;
+        return data;
     }
 
-    // Local cache of verts
-    std::vector<Vec3> verts;
-    while (!f.eof()) {
-        char line[128];
-        f.getline(line, 128);
-        std::stringstream s;
-        s << line;
-        char junk;
-        if (line[0] == 'v') {
+    std::map<std::string, int> material_slots;
+    int current_material = 0;
+    data->material_names.push_back("default");
+
+    std::string line;
+    while (std::getline(f, line)) {
+        std::stringstream s(line);
+        std::string type;
+        s >> type;
+        if (type == "v") {
             Vec3 v = VEC3_ZERO;
-            s >> junk >> v.x >> v.y >> v.z;
-            verts.push_back(v);
+            s >> v.x >> v.y >> v.z;
+            data->vertices.push_back(v);
+        }
+        else if (type == "usemtl") {
+            std::string name;
+            s >> name;
+            if(!material_slots.count(name)) {
+                // the first usemtl take over the default slot if no face use it yet
+                if(data->indices.empty() and material_slots.empty())
+                    data->material_names[0] = name;
+                else
+                    data->material_names.push_back(name);
+                material_slots[name] = data->material_names.size() - 1;
+            }
+            current_material = material_slots[name];
         }
-        if (line[0] == 'f') {
-            int f[3];
-            s >> junk >> f[0] >> f[1] >> f[2];
-            Triangle tri;
-            tri.vert[0] = verts[f[0] - 1];
-            tri.vert[1] = verts[f[1] - 1];
-            tri.vert[2] = verts[f[2] - 1];
-            out.default_tris.push_back(tri);
+        else if (type == "f") {
+            // only the vertex index of "v/vt/vn" is used, polygons are split in a fan
+            std::vector<uint32_t> face;
+            std::string token;
+            while(s >> token) {
+                int index = atoi(token.c_str());
+                if(index < 0) index += data->vertices.size() + 1;
+                face.push_back(index - 1);
+            }
+            for(int i = 1; i + 1 < (int)face.size(); i++) {
+                data->indices.push_back(face[0]);
+                data->indices.push_back(face[i]);
+                data->indices.push_back(face[i + 1]);
+                data->material_ids.push_back(current_material);
+            }
         }
     }
-    out.tris = out.default_tris;
+
+    int n = data->triangle_count();
+    std::vector<AABB> boxes(n);
+    for(int i = 0; i < n; i++)
+        for(int j = 0; j < 3; j++)
+            boxes[i].grow(data->vertices[data->indices[3 * i + j]]);
+    data->bvh.build(boxes);
+    data->bvh8.build(data->bvh);
+    for(int i = 0; i < n; i++) {
+        Triangle tri = data->triangle(data->bvh.indices[i]);
+        data->packed.add(tri.vert[0], tri.vert[1], tri.vert[2]);
+    }
+    data->packed.pad();
+
+    mesh_cache[sFilename] = data;
+    return data;
+}
+inline Mesh load_mesh_from(std::string sFilename) {
+    Mesh out;
+    out.geometry = load_mesh_data(sFilename);
+    out.materials.resize(out.geometry->material_count());
     out.calculate_AABB();
     return out;
 }
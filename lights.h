@@ -0,0 +1,206 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include "vec3.h"
+#include "constant.h"
+#include "objects.h"
+#include "helper.h"
+#include "ray.h"
+#include "sampler.h"
+
+// light sampling at diffuse bounces, weighted with bounce sampling by multiple importance sampling
+bool sample_lights = true;
+// shadow rays leave the surface along the normal by this much
+const float SHADOW_RAY_OFFSET = 1e-4f;
+
+// emissive sphere or emissive triangle of a mesh, in world space
+struct Light {
+    Object* object = nullptr;
+    // sphere centre or first vertex of the triangle
+    Vec3 p0 = VEC3_ZERO;
+    Vec3 p1 = VEC3_ZERO;
+    Vec3 p2 = VEC3_ZERO;
+    // front face of the triangle, the only one rays can hit
+    Vec3 normal = VEC3_ZERO;
+    float radius = 0;
+    float area = 0;
+    Vec3 emission = VEC3_ZERO;
+};
+// direction to a point on a light seen from a surface point
+struct LightSample {
+    Vec3 direction = VEC3_ZERO;
+    float distance = 0;
+    // solid angle density, the choice of the light included
+    float pdf = 0;
+    Vec3 emission = VEC3_ZERO;
+};
+
+// every emitter of the scene, a light is picked with a probability proportional to its power
+// spheres are sampled in the cone they cover and triangles on their area
+class Lights {
+private:
+    std::vector<Light> lights;
+    std::vector<float> cdf;
+    // light of a sphere, or first entry of a mesh in triangle_lights
+    std::unordered_map<const Object*, int> first;
+    // light of every triangle of emissive meshes in BVH order, -1 if it does not emit
+    std::vector<int> triangle_lights;
+
+    static float power(const Vec3 &emission, float area) {
+        return (emission.x + emission.y + emission.z) * area;
+    }
+    void add(const Light &light) {
+        float total = cdf.empty() ? 0 : cdf.back();
+        lights.push_back(light);
+        cdf.push_back(total + power(light.emission, light.area));
+    }
+    float probability(int i) const {
+        float p = cdf[i] - (i > 0 ? cdf[i - 1] : 0);
+        return p / cdf.back();
+    }
+    // cosine of the half angle of the cone covered by a sphere, and 1 - cosine without cancellation
+    static bool sphere_cone(const Light &light, Vec3 p, float &cos_max, float &one_minus_cos) {
+        float d2 = (light.p0 - p).squared_length();
+        float r2 = light.radius * light.radius;
+        if(d2 <= r2) return false;
+        float sin2 = r2 / d2;
+        cos_max = sqrt(1 - sin2);
+        one_minus_cos = sin2 / (1 + cos_max);
+        return true;
+    }
+    float light_pdf(int i, Vec3 p, Vec3 point) const {
+        const Light &light = lights[i];
+        if(light.radius > 0) {
+            float cos_max, one_minus_cos;
+            if(!sphere_cone(light, p, cos_max, one_minus_cos)) return 0;
+            return probability(i) / (2 * M_PI * one_minus_cos);
+        }
+        Vec3 to_light = point - p;
+        float d2 = to_light.squared_length();
+        // single sided like cast_to_mesh, a point behind the triangle can not be lit by it
+        float cos_light = -to_light.dot(light.normal) / sqrt(d2);
+        if(cos_light < 1e-6f) return 0;
+        return probability(i) * d2 / (cos_light * light.area);
+    }
+public:
+    void build(const std::vector<Object*> &objects) {
+        lights.clear();
+        cdf.clear();
+        first.clear();
+        triangle_lights.clear();
+        for(Object* obj: objects) {
+            if(!obj->visible) continue;
+            if(obj->is_sphere()) {
+                Material m = obj->get_material();
+                Light light;
+                light.object = obj;
+                light.p0 = obj->get_position();
+                light.radius = fabs(obj->get_radius());
+                light.area = 4 * M_PI * light.radius * light.radius;
+                light.emission = m.emission_color * m.emission_strength;
+                if(power(light.emission, light.area) <= 0) continue;
+                first[obj] = lights.size();
+                add(light);
+                continue;
+            }
+            if(!obj->geometry) continue;
+
+            bool emissive = false;
+            for(const Material &m: obj->materials)
+                emissive = emissive or power(m.emission_color * m.emission_strength, 1) > 0;
+            if(!emissive) continue;
+
+            const MeshData &geometry = *obj->geometry;
+            first[obj] = triangle_lights.size();
+            for(int i = 0; i < geometry.triangle_count(); i++) {
+                int tri = geometry.bvh.indices[i];
+                const Material &m = obj->materials[geometry.material_ids[tri]];
+                Triangle t = geometry.triangle(tri);
+                Light light;
+                light.object = obj;
+                light.p0 = obj->to_world.point(t.vert[0]);
+                light.p1 = obj->to_world.point(t.vert[1]);
+                light.p2 = obj->to_world.point(t.vert[2]);
+                // same normal as surface_at, the edges cross product flip with a mirroring transform
+                light.normal = obj->to_object.transposed_vector(geometry.packed.normal(i)).normalize();
+                light.area = (light.p1 - light.p0).cross(light.p2 - light.p0).length() / 2;
+                light.emission = m.emission_color * m.emission_strength;
+                if(power(light.emission, light.area) <= 0) {
+                    triangle_lights.push_back(-1);
+                    continue;
+                }
+                triangle_lights.push_back(lights.size());
+                add(light);
+            }
+        }
+    }
+    bool empty() const {
+        return lights.empty();
+    }
+    int size() const {
+        return lights.size();
+    }
+
+    // pick a light and a point on it seen from p, false if nothing can be sampled
+    bool sample(Vec3 p, Sampler &rng, LightSample &s) const {
+        if(lights.empty()) return false;
+        // the 2D pair first, see SAMPLE_DIMENSION
+        float u1 = rng.next_float();
+        float u2 = rng.next_float();
+        float u = rng.next_float() * cdf.back();
+        int i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        i = std::min(i, (int)lights.size() - 1);
+        const Light &light = lights[i];
+
+        if(light.radius > 0) {
+            float cos_max, one_minus_cos;
+            if(!sphere_cone(light, p, cos_max, one_minus_cos)) return false;
+            // uniform direction in the cone around the sphere centre
+            Vec3 w = (light.p0 - p).normalize();
+            Vec3 t = VEC3_ZERO, b = VEC3_ZERO;
+            orthonormal_basis(w, t, b);
+            float one_minus_cos_theta = u1 * one_minus_cos;
+            float cos_theta = 1 - one_minus_cos_theta;
+            float sin_theta = sqrt(fmax(0.0f, one_minus_cos_theta * (2 - one_minus_cos_theta)));
+            float phi = 2 * M_PI * u2;
+            s.direction = t * (sin_theta * cos(phi)) + b * (sin_theta * sin(phi)) + w * cos_theta;
+
+            // near intersection with the sphere along the sampled direction
+            Vec3 offset = p - light.p0;
+            float half_b = offset.dot(s.direction);
+            float c = offset.squared_length() - light.radius * light.radius;
+            s.distance = -half_b - sqrt(fmax(0.0f, half_b * half_b - c));
+            s.pdf = probability(i) / (2 * M_PI * one_minus_cos);
+        }
+        else {
+            // uniform point on the triangle
+            float su = sqrt(u1);
+            Vec3 point = light.p0 * (1 - su) + light.p1 * (su * (1 - u2)) + light.p2 * (su * u2);
+            Vec3 to_light = point - p;
+            s.distance = to_light.length();
+            if(s.distance <= 0) return false;
+            s.direction = to_light / s.distance;
+            // 0 from the back of the triangle, the sample is then rejected
+            s.pdf = light_pdf(i, p, point);
+        }
+        s.emission = light.emission;
+        return s.pdf > 0;
+    }
+    // density sample() would have given to the hit h of a ray from p
+    float pdf(Vec3 p, const HitInfo &h, Vec3 point) const {
+        auto it = first.find(h.object);
+        if(it == first.end()) return 0;
+        int i = it->second;
+        if(!h.object->is_sphere()) {
+            i = triangle_lights[i + h.primitive];
+            if(i == -1) return 0;
+        }
+        return light_pdf(i, p, point);
+    }
+};
+
+// power heuristic
+inline float mis_weight(float pdf, float other_pdf) {
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
@@ -1,5 +1,7 @@
 #include <SDL2/SDL_events.h>
 #include <thread>
+#include <mutex>
+#include <atomic>
 
 // debug
 #include <iostream>
@@ -9,24 +11,78 @@
 #include "constant.h"
 #include "graphics.h"
 #include "objects.h"
+#include "tlas.h"
+#include "sphere_grid.h"
+#include "thread_pool.h"
+#include "triple_buffer.h"
+#include "framebuffer.h"
+#include "lights.h"
+#include "bsdf.h"
+#include "denoiser.h"
+#include "reprojection.h"
 
 // #include "nlohmann/json.hpp"
 // using json = nlohmann::json;
 
 int WIDTH = 320;
 int HEIGHT = 180;
-
-int thread_width = WIDTH / column_threads;
-int thread_height = HEIGHT / row_threads;
-std::vector<std::thread> threads;
+// side of the square pieces of the viewport handed to the render workers
+const int TILE_SIZE = 16;
+// paths can be stopped by russian roulette from this bounce, and always continue with at most this probability
+const int ROULETTE_MIN_BOUNCE = 3;
+const float ROULETTE_MAX_SURVIVAL = 0.95f;
 
 bool running = true;
 int stationary_frames_count = 0;
+// bumped by the main thread on every change that make the frame in progress stale,
+// workers stop at the next tile and the frame is thrown away
+std::atomic<unsigned> render_epoch(0);
+// epoch of the last frame started by the draw thread
+unsigned drawn_epoch = 0;
+// epoch started by the last change of the scene, later epochs only moved the camera
+std::atomic<unsigned> scene_epoch(0);
+// epoch of the last published frame and the camera it was drawn from, for the reprojection
+unsigned published_epoch = 0;
+Camera published_camera;
+// path index of the first sample of a pixel, and bound of the indices used since then
+// the new samples of a reprojected frame go on after the history instead of drawing the same paths again
+uint32_t sample_base = 0;
+uint32_t sample_end = 0;
+// an accumulation frame is dropped as soon as its epoch is old
+// the first frame after a change is still finished, or nothing would be shown while the camera keep moving
+bool frame_is_stale(unsigned epoch) {
+    return stationary_frames_count > 0 and render_epoch.load(std::memory_order_relaxed) != epoch;
+}
+// time of the last change in steady clock nanoseconds, and the delay until the first frame published after it
+std::atomic<long long> restart_time(0);
+double restart_latency = 0;
 bool camera_moving = false;
 double delay = 0;
+// rays cast by ray_trace during the current frame, for the traversal speed report
+// each tile count its own and add them once at the end
+std::atomic<long> rays_cast(0);
+double rays_per_second = 0;
 bool keyhold[12];
 
 int render_frame_count = 3;
+// the first frame after a change is drawn at render_scale of the viewport size,
+// the scale follow the measured delay so a moving view stay around target_frame_time
+bool dynamic_resolution = true;
+float target_frame_time = 33.0f;
+float render_scale = 1.0f;
+const float MIN_RENDER_SCALE = 0.25f;
+// with a threshold above 0 pixels whose relative error went below it are not sampled anymore
+// and rendering stop before render_frame_count when none is left
+float noise_threshold = 0;
+// samples before a pixel can be called converged, and luminance under which the error is absolute
+const int ADAPTIVE_MIN_SAMPLES = 16;
+const float NOISE_FLOOR = 0.05f;
+// pixels still sampled during the frame in progress and the last finished one
+std::atomic<int> noisy_pixel_count(0);
+int noisy_pixels = 0;
+// the samples of a full frame are shared by the noisy pixels, each get at most this many times ray_per_pixel
+const int ADAPTIVE_MAX_BOOST = 64;
+int adaptive_boost = 1;
 
 int mouse_pos_x;
 int mouse_pos_y;
@@ -40,13 +96,22 @@ bool lazy_ray_trace = false;
 
 SDL sdl(CHAR("ray tracer"), WIDTH, HEIGHT);
 
-std::vector<std::vector<Vec3>> screen_color(MAX_WIDTH, v_height);
-std::vector<std::vector<Vec3>> buffer = screen_color;
+// accumulated frames, workers write the back one while the GUI show the front one
+TripleBuffer<Framebuffer> frames;
 
 Camera camera;
+// copy of the camera the workers use for the frame in progress, its size is the one of the frame
+Camera render_camera;
 
 // all object pointer in the scene
 std::vector<Object*> objects;
+// acceleration structure over objects, rebuilt by the draw thread between frames
+TLAS tlas;
+Lights lights;
+SphereGrid sphere_grid;
+int built_sphere_acceleration = -1;
+bool scene_changed = true;
+std::mutex scene_mutex;
 bool sphere_request, mesh_request;
 std::string request_mesh_name;
 Mesh FOCAL_PLANE;
@@ -59,173 +124,416 @@ Vec3 get_environment_light(Vec3 dir) {
     return lerp(down_sky_color, up_sky_color, level);
 }
 
-// get closest hit of a ray
-HitInfo ray_collision(Ray ray) {
-    HitInfo closest_hit;
-    closest_hit.distance = INFINITY;
-    // find the first intersect point in all sphere
-    for(Object* obj: objects) {
-        if(!obj->visible) continue;
-
-        HitInfo h;
-        if(obj->is_sphere())
-            h = ray.cast_to_sphere(obj->get_position(), obj->get_radius(), obj->get_material(), obj->ray_inside);
-        else
-            h = ray.cast_to_mesh(obj->AABB_min, obj->AABB_max, obj->tris, obj->ray_inside);
-
-        if(h.did_hit and h.distance < closest_hit.distance) {
-            closest_hit = h;
-            closest_hit.object = obj;
+// get closest hit of a ray, medium is the stack of objects the path is inside of
+HitInfo ray_collision(Ray ray, const MediumStack &medium) {
+    HitInfo grid_hit;
+    if(built_sphere_acceleration == SPHERE_GRID) {
+        grid_hit = sphere_grid.cast(ray, medium);
+        // the scene BVH only has to find something closer
+        if(grid_hit.did_hit) ray.max_range = grid_hit.distance;
+    }
+    auto leaf = [&](int first, int count, HitInfo &closest) {
+        HitInfo h = ray.cast_to_spheres(tlas.spheres, nullptr, first, count, medium);
+        if(h.did_hit and h.distance < closest.distance) closest = h;
+
+        // only meshes are left, spheres have no geometry
+        for(int i = first; i < first + count; i++) {
+            Object* obj = tlas.spheres.objects[i];
+            if(!obj->geometry or !obj->visible) continue;
+
+            h = ray.cast_to_mesh(*obj->geometry, obj->to_object, medium.inside(obj));
+            if(h.did_hit and h.distance < closest.distance) {
+                closest = h;
+                closest.object = obj;
+            }
         }
+    };
+    HitInfo h = bvh_layout == BVH_WIDE8 ? ray.cast_to_BVH8(tlas.bvh8, leaf) : ray.cast_to_BVH(tlas.bvh, leaf);
+    if(h.did_hit and h.distance < grid_hit.distance) return h;
+    return grid_hit;
+}
+// true if anything block the ray before tmax
+// skip normal and material lookup, used for visibility test
+// the caller should offset the ray origin so it does not hit its own surface
+bool occluded(Ray ray, float tmax) {
+    ray.max_range = fmin(ray.max_range, tmax);
+    if(built_sphere_acceleration == SPHERE_GRID and sphere_grid.occluded(ray)) return true;
+    auto any_hit = [&](int first, int count) {
+        if(occluded_by_spheres(tlas.spheres, nullptr, first, count, ray.origin, ray.direction, ray.max_range)) return true;
+        for(int i = first; i < first + count; i++) {
+            Object* obj = tlas.spheres.objects[i];
+            if(obj->geometry and obj->visible and ray.occluded_by_mesh(*obj->geometry, obj->to_object)) return true;
+        }
+        return false;
+    };
+    if(bvh_layout == BVH_WIDE8) return ray.occluded_in_BVH8(tlas.bvh8, any_hit);
+    return ray.occluded_in_BVH(tlas.bvh, any_hit);
+}
+// rebuild the scene BVH if objects were added, removed or moved
+// with the grid the spheres are moved cell by cell instead of rebuilding
+void update_scene() {
+    std::lock_guard<std::mutex> lock(scene_mutex);
+    bool rebuild = scene_changed or built_sphere_acceleration != sphere_acceleration;
+    built_sphere_acceleration = sphere_acceleration;
+    scene_changed = false;
+    // materials may have changed even if nothing moved
+    lights.build(objects);
+
+    if(sphere_acceleration != SPHERE_GRID) {
+        if(rebuild or tlas.need_rebuild(objects))
+            tlas.build(objects);
+        return;
     }
 
-    return closest_hit;
+    std::vector<Object*> others;
+    std::vector<Object*> spheres;
+    for(Object* obj: objects) {
+        if(obj->is_sphere()) spheres.push_back(obj);
+        else others.push_back(obj);
+    }
+    if(rebuild or sphere_grid.need_rebuild(spheres) or !sphere_grid.update())
+        sphere_grid.build(spheres);
+    others.insert(others.end(), sphere_grid.large.begin(), sphere_grid.large.end());
+    if(rebuild or tlas.need_rebuild(others))
+        tlas.build(others);
+}
+// light reflected toward wo from one sampled emitter, weighted against bounce sampling
+Vec3 direct_light(Vec3 point, Vec3 normal, const BSDF &bsdf, Vec3 wo, float max_range, Sampler &rng) {
+    LightSample l;
+    if(!lights.sample(point, rng, l) or l.distance > max_range) return BLACK;
+    Vec3 f = bsdf.eval(wo, l.direction);
+    if(f == BLACK) return BLACK;
+
+    Ray shadow;
+    shadow.origin = point + normal * SHADOW_RAY_OFFSET;
+    shadow.direction = l.direction;
+    shadow.max_range = max_range;
+    // stop short of the light so it does not hide itself
+    if(occluded(shadow, l.distance * (1 - SHADOW_RAY_OFFSET))) return BLACK;
+
+    return l.emission * f * (mis_weight(l.pdf, bsdf.pdf(wo, l.direction)) / l.pdf);
 }
-Vec3 ray_trace(int x, int y) {
+// sample is the index of the path in the pixel, it choose the random numbers of the path
+// first_hit receive the surface seen from the camera, for the denoiser, and rays is increased by the rays cast
+Vec3 ray_trace(int x, int y, uint32_t sample, SurfaceSample &first_hit, long &rays) {
     Vec3 ray_color = WHITE;
     Vec3 incomming_light = BLACK;
-    float current_refractive_index = RI_AIR;
-    Ray ray = camera.ray(x, y);
-
-    for(int i = 1; i <= camera.max_ray_bounce_count; i++) {
-        HitInfo h = ray_collision(ray);
+    // the camera is assumed to be in the air
+    MediumStack medium;
+    Sampler rng(x, y, sample);
+    Ray ray = render_camera.ray(x, y, rng);
+    // density of the last bounce direction when the light was also sampled there, 0 otherwise
+    float bounce_pdf = 0;
+
+    int bounce_count = 0;
+    for(int i = 1; i <= render_camera.max_ray_bounce_count; i++) {
+        rng.set_bounce(i);
+        HitInfo h = ray_collision(ray, medium);
+        bounce_count++;
 
         if(h.did_hit) {
+            // shade only the closest hit
+            SurfaceInfo s = ray.surface_at(h);
+            Vec3 emitted_light = s.material.emission_color * s.material.emission_strength;
+            // light sampling at the last bounce could have found this point too
+            float weight = 1;
+            if(bounce_pdf > 0 and emitted_light != BLACK)
+                weight = mis_weight(bounce_pdf, lights.pdf(ray.origin, h, s.point));
+            incomming_light += emitted_light * ray_color * weight;
+
+            Vec3 color = s.material.color;
+            if(s.material.texture.image_texture) {
+                if(s.material.texture.sphere_texture)
+                    color = s.material.texture.get_sphere_texture(s.normal);
+            }
+            if(i == 1) {
+                first_hit.albedo = s.material.transparent ? WHITE : lerp(color, s.material.specular_color, s.material.metal);
+                first_hit.normal = s.normal;
+                first_hit.position = s.point;
+                first_hit.depth = h.distance;
+            }
+
             Vec3 old_direction = ray.direction;
-            ray.origin = h.point;
-            Vec3 diffuse_direction = (h.normal + random_direction()).normalize();
-            Vec3 specular_direction = reflection(h.normal, old_direction);
-            float rand = random_val();
-            bool is_specular_bounce = h.material.metal > rand;
-
-            if(!h.material.transparent) {
-                ray.direction = lerp(diffuse_direction, specular_direction, (1 - h.material.roughness) * is_specular_bounce);
+            ray.origin = s.point;
+            bounce_pdf = 0;
+
+            if(!s.material.transparent) {
+                BSDF bsdf(s.normal, s.material, color);
+                Vec3 wo = -old_direction.normalize();
+
+                // add the light of one sampled emitter
+                // not at the last bounce, the path could not reach the emitter from there either
+                bool last_bounce = i == render_camera.max_ray_bounce_count;
+                bool light_sampled = !bsdf.is_delta() and !last_bounce and sample_lights and !lights.empty();
+                if(light_sampled) {
+                    rng.set_dimension(DIMENSION_LIGHT);
+                    incomming_light += ray_color * direct_light(s.point, s.normal, bsdf, wo, ray.max_range, rng);
+                    bounce_count++;
+                }
+
+                BSDFSample b;
+                rng.set_dimension(DIMENSION_BSDF);
+                if(!bsdf.sample(wo, rng, b)) break;
+                ray.direction = b.direction;
+                ray_color = ray_color * b.weight;
+                if(light_sampled) bounce_pdf = b.pdf;
             }
             // use refraction ray instead
             else {
+                Vec3 specular_direction = reflection(s.normal, old_direction);
+                rng.set_dimension(DIMENSION_BSDF + 2);
+                float rand = random_val(rng);
                 Vec3 refraction_direction(0, 0, 0);
-                float ri_ratio = current_refractive_index / h.material.refractive_index;
+                // leaving the object go back to the medium around it
+                float next_refractive_index = h.inside ? medium.refractive_index_outside(h.object) : s.material.refractive_index;
+                float ri_ratio = medium.refractive_index() / next_refractive_index;
 
-                float cos_theta = -ray.direction.dot(h.normal);
+                float cos_theta = -ray.direction.dot(s.normal);
                 float sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 
                 bool cannot_refract = ri_ratio * sin_theta > 1.0;
                 if(cannot_refract or reflectance(cos_theta, ri_ratio) > rand)
                     refraction_direction = specular_direction;
                 else {
-                    refraction_direction = refraction(h.normal, old_direction, ri_ratio);
-                    current_refractive_index = h.material.refractive_index;
-                    h.object->ray_inside = !h.object->ray_inside;
+                    refraction_direction = refraction(s.normal, old_direction, ri_ratio);
+                    if(h.inside) medium.leave(h.object);
+                    else medium.enter(h.object, next_refractive_index);
                 }
 
                 ray.direction = refraction_direction;
-            }
-            
-            Vec3 emitted_light = h.material.emission_color * h.material.emission_strength;
-            incomming_light += emitted_light * ray_color;
-            
-            Vec3 color = h.material.color;
-            if(h.material.texture.image_texture) {
-                if(h.material.texture.sphere_texture)
-                    color = h.material.texture.get_sphere_texture(h.normal);
+                ray_color = ray_color * lerp(color, s.material.specular_color, s.material.metal > rand);
             }
 
-            ray_color = ray_color * lerp(color, h.material.specular_color, is_specular_bounce);
+            // russian roulette, a dim path stop early and the surviving ones are made brighter to compensate
+            if(i >= ROULETTE_MIN_BOUNCE) {
+                float survive = fmin(fmax(ray_color.x, fmax(ray_color.y, ray_color.z)), ROULETTE_MAX_SURVIVAL);
+                rng.set_dimension(DIMENSION_ROULETTE);
+                if(random_val(rng) >= survive) break;
+                ray_color /= survive;
+            }
         }
         else {
             incomming_light += ray_color * get_environment_light(ray.direction);
+            if(i == 1) {
+                first_hit.albedo = WHITE;
+                first_hit.normal = VEC3_ZERO;
+                first_hit.position = VEC3_ZERO;
+                first_hit.depth = 0;
+            }
             break;
         }
     }
+    rays += bounce_count;
     return incomming_light;
 }
 
-void drawing_in_rectangle(int from_x, int to_x, int from_y, int to_y) {
-    for(int x = from_x; x <= to_x; x++)
-        for(int y = from_y; y <= to_y; y++) {
-            Vec3 draw_color = BLACK;
+void drawing_in_rectangle(int from_x, int to_x, int from_y, int to_y, unsigned epoch) {
+    const Framebuffer &screen_color = frames.previous_frame();
+    Framebuffer &buffer = frames.back_frame();
+    // a frame of another size is left from before a resize and can not be blended
+    bool has_previous = stationary_frames_count > 0 and screen_color.same_size(buffer);
+    int width = buffer.width();
+    int height = buffer.height();
+    int noisy = 0;
+    long rays = 0;
+    // an interpolated pixel has no noise of its own, adaptive sampling would take it as converged
+    bool lazy = lazy_ray_trace and noise_threshold <= 0;
+
+    for(int y = from_y; y <= to_y; y++) {
+        // a row can be slow with many rays per pixel, do not finish it for nothing
+        if(frame_is_stale(epoch)) return;
+        for(int x = from_x; x <= to_x; x++) {
+            const Pixel* old = has_previous ? &screen_color.at(x, y) : nullptr;
+            float samples = old ? old->samples : 0;
+            // a converged pixel cost nothing more than a copy
+            if(noise_threshold > 0 and samples >= ADAPTIVE_MIN_SAMPLES and old->relative_error(NOISE_FLOOR) <= noise_threshold) {
+                buffer.at(x, y) = *old;
+                buffer.surface(x, y) = screen_color.surface(x, y);
+                continue;
+            }
+            noisy++;
 
-            int lazy_ray_trace_condition = x + y * WIDTH + (WIDTH % 2 == 0 and y % 2 == 1);
+            int sample_count = render_camera.ray_per_pixel * adaptive_boost;
+            Vec3 draw_color = BLACK;
+            float moment = 0;
+            SurfaceSample surface;
+            int lazy_ray_trace_condition = x + y * width + (width % 2 == 0 and y % 2 == 1);
             // lazy ray trace
             // do not run if frame count is 0
-            if(lazy_ray_trace and lazy_ray_trace_condition % 2 == 0 and stationary_frames_count > 0) {
+            if(lazy and lazy_ray_trace_condition % 2 == 0 and has_previous) {
                 // calculate number of neighbor
                 bool u, d, l, r;
                 u = y > 0;
-                d = y < HEIGHT - 1;
+                d = y < height - 1;
                 l = x > 0;
-                r = x < WIDTH - 1;
+                r = x < width - 1;
                 int neighbor_count = u + d + l + r;
 
-                if(u) draw_color += screen_color[x][y-1];
-                if(d) draw_color += screen_color[x][y+1];
-                if(l) draw_color += screen_color[x-1][y];
-                if(r) draw_color += screen_color[x+1][y];
+                if(u) draw_color += screen_color.color(x, y-1);
+                if(d) draw_color += screen_color.color(x, y+1);
+                if(l) draw_color += screen_color.color(x-1, y);
+                if(r) draw_color += screen_color.color(x+1, y);
                 draw_color /= neighbor_count;
+                moment = luminance(draw_color) * luminance(draw_color);
+                surface = screen_color.surface(x, y);
             }
             else {
                 // make more ray per pixel for more accurate color in one frame
                 // but decrease performance
-                for(int k = 1; k <= camera.ray_per_pixel; k++) {
-                    draw_color += ray_trace(x, y);
+                for(int k = 0; k < sample_count; k++) {
+                    SurfaceSample first_hit;
+                    Vec3 c = ray_trace(x, y, sample_base + (int)samples + k, first_hit, rays);
+                    draw_color += c;
+                    moment += luminance(c) * luminance(c);
+                    surface.blend(first_hit, 1.0f / (k + 1));
                 }
-                draw_color /= camera.ray_per_pixel;
+                draw_color /= sample_count;
+                moment /= sample_count;
             }
 
-            // progressive rendering
-            float w = 1.0f / (stationary_frames_count + 1);
-            draw_color = screen_color[x][y] * (1 - w) + draw_color * w;
-            buffer[x][y] = draw_color;
+            // progressive rendering, running mean over the samples accumulated in the pixel
+            float w = sample_count / (samples + sample_count);
+            if(old) {
+                draw_color = old->color() * (1 - w) + draw_color * w;
+                moment = old->luminance_moment * (1 - w) + moment * w;
+                SurfaceSample blended = screen_color.surface(x, y);
+                blended.blend(surface, w);
+                surface = blended;
+            }
+            buffer.at(x, y).set(draw_color, samples + sample_count, moment);
+            buffer.surface(x, y) = surface;
         }
+    }
+    noisy_pixel_count += noisy;
+    rays_cast += rays;
 }
 void draw_frame() {
     auto start = std::chrono::system_clock::now();
 
-    // start all draw thread
-    for(int w = 0; w < column_threads; w++)
-        for(int h = 0; h < row_threads; h++) {
-            int draw_from_x = w * thread_width;
-            int draw_to_x = (w + 1) * thread_width - 1;
-            int draw_from_y = h * thread_height;
-            int draw_to_y = (h + 1) * thread_height - 1;
-            threads.push_back(std::thread(drawing_in_rectangle, draw_from_x, draw_to_x, draw_from_y, draw_to_y));
-        }
-    // wait till all threads are finished
-    for(int i = 0; i < (int)threads.size(); i++)
-        threads[i].join();
-    threads.clear();
-
-    // copy buffer to screen
-    screen_color = buffer;
+    // something changed since the last frame, start the accumulation again
+    // if only the camera moved the last frame is reprojected on top of the new samples
+    unsigned epoch = render_epoch;
+    bool reproject = false;
+    if(epoch != drawn_epoch) {
+        drawn_epoch = epoch;
+        stationary_frames_count = 0;
+        reproject = temporal_reprojection and scene_epoch <= published_epoch;
+    }
+    denoise_changed = false;
+    // nothing moved if the frame is accumulated on top of the last one
+    if(stationary_frames_count == 0)
+        update_scene();
+    rays_cast = 0;
+
+    int thread_count = render_thread_count;
+    if(render_pool.size() != thread_count)
+        render_pool.resize(thread_count);
+    // update_camera change the viewport size, the frame follow before any worker use it
+    // a frame after a change may be smaller, accumulation is always at the full size
+    bool scaled = dynamic_resolution and stationary_frames_count == 0 and render_scale < 1;
+    int render_width = scaled ? std::max(2, (int)(WIDTH * render_scale + 0.5f)) : WIDTH;
+    int render_height = scaled ? std::max(2, (int)(HEIGHT * render_scale + 0.5f)) : HEIGHT;
+    Framebuffer &back = frames.back_frame();
+    if(back.width() != render_width or back.height() != render_height) {
+        if(scaled) back.reshape(render_width, render_height);
+        else back.resize(render_width, render_height);
+    }
+    int width = back.width();
+    int height = back.height();
+    // the viewport of the camera stay the same, only its pixels are bigger
+    render_camera = camera;
+    render_camera.WIDTH = width;
+    render_camera.HEIGHT = height;
+    // once still, the smaller frames drawn while moving are the history of the first full size one
+    const Framebuffer &previous = frames.previous_frame();
+    if(stationary_frames_count > 0 and !previous.same_size(back) and published_epoch == epoch)
+        reproject = temporal_reprojection;
+    reproject = reproject and previous.width() > 0;
+
+    // small tiles so the workers stay balanced, edge tiles are cut to the viewport
+    int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    noisy_pixel_count = 0;
+    adaptive_boost = 1;
+    if(noise_threshold > 0 and stationary_frames_count > 0 and noisy_pixels > 0 and previous.same_size(back))
+        adaptive_boost = std::min(width * height / noisy_pixels, ADAPTIVE_MAX_BOOST);
+    // a frame that does not accumulate on the last one start a new range of indices,
+    // after the history it reproject or back at 0 if there is none
+    if(stationary_frames_count == 0 or !previous.same_size(back)) {
+        sample_base = reproject ? sample_end : 0;
+        sample_end = sample_base + (reproject ? (uint32_t)REPROJECT_MAX_SAMPLES : 0);
+    }
+    sample_end += render_camera.ray_per_pixel * adaptive_boost;
+    render_pool.run(tiles_x * tiles_y, [tiles_x, width, height, epoch](int tile, int worker) {
+        if(frame_is_stale(epoch)) return;
+        int draw_from_x = tile % tiles_x * TILE_SIZE;
+        int draw_from_y = tile / tiles_x * TILE_SIZE;
+        int draw_to_x = std::min(draw_from_x + TILE_SIZE, width) - 1;
+        int draw_to_y = std::min(draw_from_y + TILE_SIZE, height) - 1;
+        drawing_in_rectangle(draw_from_x, draw_to_x, draw_from_y, draw_to_y, epoch);
+    });
+
+    // a stale frame is never published, the next one start over
+    if(frame_is_stale(epoch)) return;
+
+    if(reproject) reprojector.apply(back, previous, published_camera, render_pool);
+
+    // only the shown color is filtered, the accumulation go on with the noisy one
+    if(denoise) denoiser.apply(back, render_pool);
+    else back.set_filtered(false);
+
+    // hand the frame to the GUI, no copy
+    frames.publish();
+    published_epoch = epoch;
+    published_camera = render_camera;
+    noisy_pixels = noisy_pixel_count;
+    if(stationary_frames_count == 0 and render_epoch == epoch) {
+        long long now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        restart_latency = (now - restart_time) / 1e6;
+    }
 
     auto end = std::chrono::system_clock::now();
 
     std::chrono::duration<double> elapsed = end - start;
     delay = elapsed.count() * 1000;
+    rays_per_second = rays_cast / elapsed.count();
+
+    // the time of a frame is about proportional to its pixel count
+    if(dynamic_resolution and stationary_frames_count == 0) {
+        float full_size_time = delay * WIDTH * HEIGHT / (width * height);
+        float scale = sqrt(target_frame_time / full_size_time);
+        // half way there so one slow frame does not make the next one tiny
+        render_scale = fmin(fmax(render_scale + (scale - render_scale) * 0.5f, MIN_RENDER_SCALE), 1.0f);
+    }
     
     stationary_frames_count++;
 }
 
+// called by the main thread when only the camera moved, the accumulated samples can be reprojected
+void restart_view() {
+    restart_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    render_epoch++;
+}
+// called by the main thread when the scene or the camera settings changed, the accumulated samples are lost
+void restart_render() {
+    // set before the epoch so a frame that see the new epoch also see it is a scene change
+    scene_epoch = render_epoch + 1;
+    restart_view();
+}
+
 void update_camera() {
-    float tilted_a = camera.tilted_angle;
-    float panned_a = camera.panned_angle;
-    camera.reset_rotation();
     camera.WIDTH = WIDTH;
     camera.HEIGHT = HEIGHT;
     camera.init();
 
-    camera.tilt(tilted_a);
-    camera.pan(panned_a);
-
-    thread_width = WIDTH / column_threads;
-    thread_height = HEIGHT / row_threads;
-
-    stationary_frames_count = 0;
+    restart_render();
 }
 
 void draw_to_window() {
     while(running) {
-        if(stationary_frames_count <= render_frame_count)
+        bool converged = noise_threshold > 0 and stationary_frames_count > 0 and noisy_pixels == 0;
+        // one more frame show new denoiser settings on a finished image
+        if((stationary_frames_count <= render_frame_count and !converged) or render_epoch != drawn_epoch or denoise_changed)
             draw_frame();
     }
 }
@@ -240,6 +548,7 @@ int meshes_array_length = 0;
 std::vector<int> middle_space2;
 
 void add_sphere() {
+    std::lock_guard<std::mutex> lock(scene_mutex);
     Sphere sphere;
     sphere.set_radius(1);
     sphere.set_position(VEC3_ZERO);
@@ -255,9 +564,11 @@ void add_sphere() {
     }
     spheres[index] = sphere;
     objects.push_back(spheres + index);
+    scene_changed = true;
     selecting_object = spheres + index;
 }
 void add_mesh() {
+    std::lock_guard<std::mutex> lock(scene_mutex);
     Mesh mesh = load_mesh_from(request_mesh_name);
 
     int index;
@@ -271,14 +582,17 @@ void add_mesh() {
     }
     meshes[index] = mesh;
     objects.push_back(meshes + index);
+    scene_changed = true;
     selecting_object = meshes + index;
 }
 void remove_object(Object* obj) {
     selecting_object = nullptr;
     if(obj == &FOCAL_PLANE) return;
+    std::lock_guard<std::mutex> lock(scene_mutex);
     for(int i = 0; i < (int)objects.size(); i++)
         if(objects[i] == obj) {
             objects.erase(objects.begin() + i);
+            scene_changed = true;
             break;
         }
 
@@ -331,7 +645,7 @@ int main() {
 
         // force render
         if(sphere_request or mesh_request)
-            stationary_frames_count = 0;
+            restart_render();
         if(sphere_request)
             add_sphere();
         if(mesh_request)
@@ -352,7 +666,10 @@ int main() {
                 mouse_pos_x *= WIDTH / (float)w;
                 mouse_pos_y *= HEIGHT / (float)h;
 
-                HitInfo hit = ray_collision(camera.ray(mouse_pos_x, mouse_pos_y));
+                Sampler rng(mouse_pos_x, mouse_pos_y, 0);
+                scene_mutex.lock();
+                HitInfo hit = ray_collision(camera.ray(mouse_pos_x, mouse_pos_y, rng), MediumStack());
+                scene_mutex.unlock();
                 if(hit.did_hit) {
                     selecting_object = hit.object;
                 }
@@ -424,7 +741,7 @@ int main() {
         if(keyhold[9]) camera.position.y -= speed;
         camera_moving = camera_changed;
 
-        if(camera_moving) stationary_frames_count = 0;
+        if(camera_moving) restart_view();
 
         float old_FOV = camera.FOV;
         float old_focal_length = camera.focal_length;
@@ -432,12 +749,13 @@ int main() {
         float old_blur_rate = camera.blur_rate;
 
         sdl.gui(
-            &screen_color,
-            &lazy_ray_trace, &render_frame_count, &stationary_frames_count, delay,
+            &frames.acquire(),
+            &lazy_ray_trace, &render_frame_count, &stationary_frames_count, &noise_threshold, noisy_pixels, delay, rays_per_second, restart_latency,
+            &dynamic_resolution, &target_frame_time, render_scale,
             &WIDTH, &HEIGHT,
             &objects, selecting_object,
             &sphere_request, &mesh_request, &request_mesh_name,
-            &remove_object,
+            &remove_object, &restart_render,
             &camera,
             &up_sky_color, &down_sky_color,
             &running
@@ -0,0 +1,52 @@
+#pragma once
+#include "constant.h"
+#include "objects.h"
+
+// nested transparent objects a path is inside of, innermost on top
+const int MEDIUM_STACK_SIZE = 8;
+
+// carried by each path instead of a flag on the shared object,
+// so scene objects are only read while rendering
+class MediumStack {
+private:
+    const Object* objects[MEDIUM_STACK_SIZE];
+    float refractive_indices[MEDIUM_STACK_SIZE];
+    int count = 0;
+
+    int find(const Object* obj) const {
+        for(int i = count - 1; i >= 0; i--)
+            if(objects[i] == obj) return i;
+        return -1;
+    }
+public:
+    bool inside(const Object* obj) const {
+        return count > 0 and find(obj) != -1;
+    }
+    // index of the medium the path is in, air outside of everything
+    float refractive_index() const {
+        return count > 0 ? refractive_indices[count - 1] : RI_AIR;
+    }
+    // index of the medium the path get in when it leave obj
+    float refractive_index_outside(const Object* obj) const {
+        for(int i = count - 1; i >= 0; i--)
+            if(objects[i] != obj) return refractive_indices[i];
+        return RI_AIR;
+    }
+    // deeper nesting is ignored, the path is then treated as outside
+    void enter(const Object* obj, float refractive_index) {
+        if(count == MEDIUM_STACK_SIZE) return;
+        objects[count] = obj;
+        refractive_indices[count] = refractive_index;
+        count++;
+    }
+    // obj may not be on top when overlapping objects are left in another order
+    void leave(const Object* obj) {
+        int i = find(obj);
+        if(i == -1) return;
+        for(; i < count - 1; i++) {
+            objects[i] = objects[i + 1];
+            refractive_indices[i] = refractive_indices[i + 1];
+        }
+        count--;
+    }
+};
@@ -1,27 +1,64 @@
 #pragma once
 #include <vector>
+#include <memory>
+#include <string>
+#include <stdint.h>
 #include "transformation.h"
 #include "vec3.h"
 #include "constant.h"
 #include "material.h"
+#include "bvh.h"
+#include "bvh8.h"
+#include "triangle_simd.h"
 
 class Triangle {
 public:
     Vec3 vert[3] = {VEC3_ZERO, VEC3_ZERO, VEC3_ZERO};
-    Material material;
+};
+// indexed triangles and BVH of a model in its own space
+// shared by every mesh loaded from the same file and never modified after loading
+struct MeshData {
+    std::vector<Vec3> vertices;
+    // 3 vertex indices per triangle
+    std::vector<uint32_t> indices;
+    // slot in the mesh material table of every triangle
+    std::vector<uint16_t> material_ids;
+    // name of every material slot, from usemtl
+    std::vector<std::string> material_names;
+
+    BVH bvh;
+    // same leaves as bvh collapsed to 8 wide nodes
+    BVH8 bvh8;
+    // triangles in BVH order with precomputed edges for the intersection kernels
+    TriangleSoA packed;
+
+    int triangle_count() const {
+        return indices.size() / 3;
+    }
+    Triangle triangle(int i) const {
+        Triangle tri;
+        for(int j = 0; j < 3; j++)
+            tri.vert[j] = vertices[indices[3 * i + j]];
+        return tri;
+    }
+    int material_count() const {
+        return material_names.size();
+    }
 };
 class Object {
 public:
     Vec3 position = VEC3_ZERO;
     Vec3 rotation = VEC3_ZERO;
     Material material;
-    bool ray_inside = false;
     bool visible = true;
-    // mesh variable
+    // bounding box in world space, used by the scene BVH
     Vec3 AABB_min = VEC3_ZERO;
     Vec3 AABB_max = VEC3_ZERO;
-    std::vector<Triangle> tris;
-    std::vector<Triangle> default_tris;
+    // mesh variable
+    std::shared_ptr<const MeshData> geometry;
+    std::vector<Material> materials;
+    Transform to_world;
+    Transform to_object;
 
     virtual void set_position(Vec3 p) {
         return;
@@ -57,6 +94,9 @@ public:
     virtual bool is_sphere() {
         return false;
     }
+    virtual void set_transform(Transform tf) {
+        return;
+    }
     virtual void calculate_AABB() {
         return;
     }
@@ -65,14 +105,21 @@ class Sphere: public Object {
 private:
     float radius = 1;
 public:
+    void calculate_AABB() {
+        Vec3 r = Vec3(1, 1, 1) * fabs(radius);
+        AABB_min = position - r;
+        AABB_max = position + r;
+    }
     void set_position(Vec3 p) {
         position = p;
+        calculate_AABB();
     }
     void set_rotation(Vec3 a) {
         rotation = a;
     }
     void set_radius(float r) {
         radius = r;
+        calculate_AABB();
     }
     float get_radius() {
         return radius;
@@ -85,67 +132,54 @@ public:
 class Mesh: public Object {
 private:
     Vec3 scale = Vec3(1, 1, 1);
+
+    void update_transform() {
+        set_transform(Transform::translation(position) * Transform::rotation(rotation) * Transform::scaling(scale));
+    }
 public:
+    // the world box is the box of the model BVH root after transformation
     void calculate_AABB() {
-        Vec3 min =  Vec3(INFINITY, INFINITY, INFINITY);
-        Vec3 max = -Vec3(INFINITY, INFINITY, INFINITY);
-        for(auto tri: tris)
-            for(int i = 0; i < 3; i++) {
-                min.x = fmin(min.x, tri.vert[i].x);
-                min.y = fmin(min.y, tri.vert[i].y);
-                min.z = fmin(min.z, tri.vert[i].z);
-                
-                max.x = fmax(max.x, tri.vert[i].x);
-                max.y = fmax(max.y, tri.vert[i].y);
-                max.z = fmax(max.z, tri.vert[i].z);
+        AABB world;
+        if(geometry and !geometry->bvh.empty()) {
+            AABB box = geometry->bvh.bounds();
+            for(int i = 0; i < 8; i++) {
+                Vec3 corner = Vec3(i & 1 ? box.max.x : box.min.x,
+                                   i & 2 ? box.max.y : box.min.y,
+                                   i & 4 ? box.max.z : box.min.z);
+                world.grow(to_world.point(corner));
             }
-        AABB_min = min;
-        AABB_max = max;
+        }
+        AABB_min = world.min;
+        AABB_max = world.max;
+    }
+    // transform edits only touch the matrices, the shared triangles stay the same
+    void set_transform(Transform tf) {
+        to_world = tf;
+        to_object = tf.inverse();
+        calculate_AABB();
     }
     void set_position(Vec3 p) {
-        for(int i = 0; i < (int)tris.size(); i++) {
-            for(int j = 0; j < 3; j++)
-                tris[i].vert[j] += -position + p;
-        }
         position = p;
+        update_transform();
     }
     void set_rotation(Vec3 a) {
-        // reset
-        tris = default_tris;
-
-        for(int i = 0; i < (int)tris.size(); i++) {
-            for(int j = 0; j < 3; j++) {
-                Vec3* pos = &(tris[i].vert[j]);
-                *pos = _scale(*pos, scale);
-                *pos = _rotate(*pos, a);
-                *pos = *pos + position;
-            }
-        }
         rotation = a;
+        update_transform();
     }
     void set_scale(Vec3 v) {
-        // reset
-        tris = default_tris;
-
-        for(int i = 0; i < (int)tris.size(); i++)
-            for(int j = 0; j < 3; j++) {
-                Vec3* pos = &(tris[i].vert[j]);
-                *pos = _rotate(*pos, rotation);
-                *pos = _scale(*pos, v);
-                *pos = *pos + position;
-            }
         scale = v;
+        update_transform();
     }
     Vec3 get_scale() {
         return scale;
     }
+    // every slot of the material table get the same material
     void set_material(Material mat) {
-        for(int i = 0; i < (int)tris.size(); i++) {
-            tris[i].material = mat;
-        }
         material = mat;
+        for(int i = 0; i < (int)materials.size(); i++)
+            materials[i] = mat;
     }
     bool is_sphere() {
         return false;
     }
-};
\ No newline at end of file
+};
@@ -3,21 +3,37 @@
 #include "constant.h"
 #include "material.h"
 #include "objects.h"
+#include "bvh.h"
+#include "bvh8.h"
+#include "sphere_simd.h"
+#include "medium.h"
 #include "helper.h"
 
+// result of an intersection test, only what is needed to find the closest hit
+// normal and material are looked up later for the closest one, see surface_at
 struct HitInfo {
     bool did_hit = false;
-    Vec3 point = VEC3_ZERO;
     float distance = INFINITY;
+    // triangle of the mesh in BVH order, unused for sphere
+    int primitive = -1;
+    // barycentric coordinates on the triangle
+    float u = 0;
+    float v = 0;
+    // the ray was inside the object and hit it from the back side
+    bool inside = false;
+    Object* object = nullptr;
+};
+// shading information of a hit point
+struct SurfaceInfo {
+    Vec3 point = VEC3_ZERO;
     Vec3 normal = VEC3_ZERO;
     Material material;
-    Object* object = nullptr;
 };
 struct Ray {
     Vec3 direction = VEC3_ZERO;
     Vec3 origin = VEC3_ZERO;
     float max_range = 50.0f;
-    HitInfo cast_to_sphere(Vec3 centre, float radius, Material mat, bool inside_object) {
+    HitInfo cast_to_sphere(Vec3 centre, float radius, bool inside_object) {
         HitInfo h;
 
         Vec3 offset_origin = origin - centre;
@@ -39,46 +55,22 @@ struct Ray {
 
             h.did_hit = true;
             h.distance = distance;
-            h.point = origin + direction * distance;
-            h.normal = (h.point - centre).normalize();
-            h.material = mat;
-            if(inside_object) {
-                h.normal = -h.normal;
-                h.material.refractive_index = RI_AIR;
-            }
+            h.inside = inside_object;
         }
         return h;
     }
-    HitInfo cast_to_triangle(Triangle tri, bool hit_backward) {
-        Vec3 edgeAB = tri.vert[1] - tri.vert[0];
-        Vec3 edgeAC = tri.vert[2] - tri.vert[0];
-
-        // flip the triangle so that ray can hit from backward side
-        if(hit_backward) std::swap(edgeAB, edgeAC);
-
-        Vec3 normalVector = edgeAB.cross(edgeAC);
-        Vec3 ao = origin - tri.vert[0];
-        Vec3 dao = ao.cross(direction);
-
-        float determinant = -(direction.dot(normalVector));
-        float invDet = 1 / determinant;
-
-        float dst = ao.dot(normalVector) * invDet;
-        if(dst > max_range) {
-            HitInfo h;
-            h.did_hit = false;
-            return h;
-        }
-        float u = edgeAC.dot(dao) * invDet;
-        float v = -(edgeAB.dot(dao)) * invDet;
-        float w = 1 - u - v;
-
+    // several spheres at once, ids is null for the contiguous range [first, first + count)
+    // medium tell which spheres the path is inside of
+    HitInfo cast_to_spheres(const SphereSoA &spheres, const int* ids, int first, int count, const MediumStack &medium) {
         HitInfo h;
-        h.did_hit = determinant >= 1e-6 && dst >= 0 && u >= 0 && v >= 0 && w >= 0;
-        h.point = origin + direction * dst;
-        h.normal = normalVector.normalize();
-        h.distance = dst;
-        h.material = tri.material;
+        SphereHit best;
+        intersect_spheres(spheres, ids, first, count, origin, direction, max_range, medium, best);
+        if(best.index == -1) return h;
+
+        h.did_hit = true;
+        h.distance = best.distance;
+        h.inside = best.inside;
+        h.object = spheres.objects[best.index];
         return h;
     }
     bool cast_to_AABB(Vec3 box_min, Vec3 box_max) {
@@ -91,19 +83,251 @@ struct Ray {
         float tFar = fmin(fmin(t2.x, t2.y), t2.z);
         return tNear <= tFar;
     }
-    HitInfo cast_to_mesh(Vec3 AABB_min, Vec3 AABB_max, std::vector<Triangle> tris, bool inside_object) {
+    // distance to where the ray enter the box, INFINITY if missed
+    float distance_to_AABB(const Vec3 &box_min, const Vec3 &box_max, const Vec3 &inv_dir) {
+        Vec3 tMin = (box_min - origin) * inv_dir;
+        Vec3 tMax = (box_max - origin) * inv_dir;
+        float tNear = fmax(fmax(fmin(tMin.x, tMax.x), fmin(tMin.y, tMax.y)), fmin(tMin.z, tMax.z));
+        float tFar = fmin(fmin(fmax(tMin.x, tMax.x), fmax(tMin.y, tMax.y)), fmax(tMin.z, tMax.z));
+        if(tNear > tFar or tFar < 0 or tNear > max_range) return INFINITY;
+        return fmax(tNear, 0);
+    }
+    // walk a BVH front to back and return the closest hit
+    // intersect(first, count, closest) test the primitives of a leaf,
+    // bvh.indices[first] to bvh.indices[first + count - 1], and update closest
+    // nodes farther than the closest hit found so far are skipped
+    template<typename F>
+    HitInfo cast_to_BVH(const BVH &bvh, F intersect) {
         HitInfo closest;
         closest.did_hit = false;
         closest.distance = INFINITY;
-        // assume that mesh.calculate_AABB() is called at least once
-        // if not collide with AABB then skip
-        if(!cast_to_AABB(AABB_min, AABB_max)) return closest;
-        // find closest hit
-        for(Triangle tri: tris) {
-            HitInfo h = cast_to_triangle(tri, inside_object);
-            if(h.did_hit and h.distance < closest.distance)
-                closest = h;
+        if(bvh.empty()) return closest;
+
+        Vec3 inv_dir = 1 / direction;
+        const BVHNode* root = &bvh.nodes[0];
+        if(distance_to_AABB(root->box_min, root->box_max, inv_dir) == INFINITY) return closest;
+
+        int stack[BVH_MAX_DEPTH];
+        float stack_distance[BVH_MAX_DEPTH];
+        int stack_size = 0;
+        int node_index = 0;
+        while(true) {
+            const BVHNode &node = bvh.nodes[node_index];
+            if(node.count > 0) {
+                intersect(node.left_first, node.count, closest);
+            }
+            else {
+                int near = node.left_first;
+                int far = near + 1;
+                float d_near = distance_to_AABB(bvh.nodes[near].box_min, bvh.nodes[near].box_max, inv_dir);
+                float d_far = distance_to_AABB(bvh.nodes[far].box_min, bvh.nodes[far].box_max, inv_dir);
+                if(d_far < d_near) {
+                    std::swap(near, far);
+                    std::swap(d_near, d_far);
+                }
+                if(d_near < closest.distance) {
+                    if(d_far < closest.distance) {
+                        stack[stack_size] = far;
+                        stack_distance[stack_size] = d_far;
+                        stack_size++;
+                    }
+                    node_index = near;
+                    continue;
+                }
+            }
+            // pop the next node that can still contain a closer hit
+            node_index = -1;
+            while(stack_size > 0) {
+                stack_size--;
+                if(stack_distance[stack_size] < closest.distance) {
+                    node_index = stack[stack_size];
+                    break;
+                }
+            }
+            if(node_index == -1) break;
+        }
+        return closest;
+    }
+    // 1 / direction but a zero component give a huge finite value instead of infinity
+    // so quantized planes with zero scale do not produce NaN
+    Vec3 safe_inverse_direction() {
+        Vec3 inv = VEC3_ZERO;
+        inv.x = fabs(direction.x) > 1e-20f ? 1 / direction.x : copysign(1e30f, direction.x);
+        inv.y = fabs(direction.y) > 1e-20f ? 1 / direction.y : copysign(1e30f, direction.y);
+        inv.z = fabs(direction.z) > 1e-20f ? 1 / direction.z : copysign(1e30f, direction.z);
+        return inv;
+    }
+    // same as cast_to_BVH for the 8 wide BVH
+    // all hit children of a node are pushed farthest first so the nearest is visited next
+    template<typename F>
+    HitInfo cast_to_BVH8(const BVH8 &bvh, F intersect) {
+        HitInfo closest;
+        closest.did_hit = false;
+        closest.distance = INFINITY;
+        if(bvh.empty()) return closest;
+
+        Vec3 inv_dir = safe_inverse_direction();
+        int stack_child[BVH8_STACK_SIZE];
+        int stack_count[BVH8_STACK_SIZE];
+        float stack_distance[BVH8_STACK_SIZE];
+        int stack_size = 1;
+        stack_child[0] = 0;
+        stack_count[0] = 0;
+        stack_distance[0] = 0;
+        while(stack_size > 0) {
+            stack_size--;
+            if(stack_distance[stack_size] >= closest.distance) continue;
+            int child = stack_child[stack_size];
+            int count = stack_count[stack_size];
+            if(count > 0) {
+                intersect(child, count, closest);
+                continue;
+            }
+
+            const BVH8Node &node = bvh.nodes[child];
+            float d[8];
+            intersect_BVH8_children(node, origin, inv_dir, fmin(max_range, closest.distance), d);
+
+            // insertion sort of the hit children, farthest first
+            int order[8];
+            int n = 0;
+            for(int i = 0; i < 8; i++) {
+                if(d[i] == INFINITY) continue;
+                int j = n++;
+                while(j > 0 and d[order[j - 1]] < d[i]) {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = i;
+            }
+            for(int k = 0; k < n; k++) {
+                stack_child[stack_size] = node.child[order[k]];
+                stack_count[stack_size] = node.count[order[k]];
+                stack_distance[stack_size] = d[order[k]];
+                stack_size++;
+            }
         }
         return closest;
     }
+    template<typename F>
+    bool occluded_in_BVH8(const BVH8 &bvh, F any_hit) {
+        if(bvh.empty()) return false;
+
+        Vec3 inv_dir = safe_inverse_direction();
+        int stack[BVH8_STACK_SIZE];
+        int stack_size = 1;
+        stack[0] = 0;
+        while(stack_size > 0) {
+            const BVH8Node &node = bvh.nodes[stack[--stack_size]];
+            float d[8];
+            intersect_BVH8_children(node, origin, inv_dir, max_range, d);
+            for(int i = 0; i < 8; i++) {
+                if(d[i] == INFINITY) continue;
+                if(node.count[i] > 0) {
+                    if(any_hit(node.child[i], node.count[i])) return true;
+                }
+                else stack[stack_size++] = node.child[i];
+            }
+        }
+        return false;
+    }
+    // true as soon as any primitive closer than max_range is hit
+    // any_hit(first, count) test the primitives of a leaf, nodes are visited in no particular order
+    template<typename F>
+    bool occluded_in_BVH(const BVH &bvh, F any_hit) {
+        if(bvh.empty()) return false;
+
+        Vec3 inv_dir = 1 / direction;
+        int stack[BVH_MAX_DEPTH];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+        while(stack_size > 0) {
+            const BVHNode &node = bvh.nodes[stack[--stack_size]];
+            if(distance_to_AABB(node.box_min, node.box_max, inv_dir) == INFINITY) continue;
+            if(node.count > 0) {
+                if(any_hit(node.left_first, node.count)) return true;
+            }
+            else {
+                stack[stack_size++] = node.left_first + 1;
+                stack[stack_size++] = node.left_first;
+            }
+        }
+        return false;
+    }
+    // both intersections count, the sphere block the ray from inside too
+    bool occluded_by_sphere(Vec3 centre, float radius) {
+        Vec3 offset_origin = origin - centre;
+        float a = direction.squared_length();
+        float b = offset_origin.dot(direction);
+        float c = offset_origin.squared_length() - radius * radius;
+        float D = b * b - a * c;
+        if(D < 0) return false;
+
+        const float sqrt_D = sqrt(D);
+        float near = (-b - sqrt_D) / a;
+        float far = (-b + sqrt_D) / a;
+        return (near > 0 and near <= max_range) or (far > 0 and far <= max_range);
+    }
+    // triangles block the ray from both side
+    bool occluded_by_mesh(const MeshData &geometry, const Transform &to_object) {
+        Ray local = *this;
+        local.origin = to_object.point(origin);
+        local.direction = to_object.vector(direction);
+
+        auto any_hit = [&](int first, int count) {
+            TriangleHit hit;
+            intersect_triangles(geometry.packed, first, count, local.origin, local.direction, 0, max_range, hit);
+            return hit.index != -1;
+        };
+        if(bvh_layout == BVH_WIDE8 and !geometry.bvh8.empty())
+            return local.occluded_in_BVH8(geometry.bvh8, any_hit);
+        return local.occluded_in_BVH(geometry.bvh, any_hit);
+    }
+    // the ray is moved into the mesh space instead of moving the triangles
+    // its direction is not normalized there so the hit distance stay the same
+    HitInfo cast_to_mesh(const MeshData &geometry, const Transform &to_object, bool inside_object) {
+        Ray local = *this;
+        local.origin = to_object.point(origin);
+        local.direction = to_object.vector(direction);
+
+        // ray hitting from inside a closed mesh see the back faces
+        float sign = inside_object ? -1 : 1;
+        TriangleHit best;
+        auto intersect = [&](int first, int count, HitInfo &closest) {
+            intersect_triangles(geometry.packed, first, count, local.origin, local.direction, sign, max_range, best);
+            closest.did_hit = best.index != -1;
+            closest.distance = best.distance;
+        };
+        HitInfo h;
+        if(bvh_layout == BVH_WIDE8 and !geometry.bvh8.empty())
+            h = local.cast_to_BVH8(geometry.bvh8, intersect);
+        else
+            h = local.cast_to_BVH(geometry.bvh, intersect);
+        h.primitive = best.index;
+        h.u = best.u;
+        h.v = best.v;
+        h.inside = inside_object;
+        return h;
+    }
+    // normal and material of the closest hit
+    SurfaceInfo surface_at(const HitInfo &h) {
+        SurfaceInfo s;
+        Object* obj = h.object;
+        s.point = origin + direction * h.distance;
+        if(obj->is_sphere()) {
+            s.normal = (s.point - obj->get_position()).normalize();
+            s.material = obj->get_material();
+            if(h.inside) {
+                s.normal = -s.normal;
+                s.material.refractive_index = RI_AIR;
+            }
+        }
+        else {
+            const MeshData &geometry = *obj->geometry;
+            float sign = h.inside ? -1 : 1;
+            s.normal = obj->to_object.transposed_vector(geometry.packed.normal(h.primitive) * sign).normalize();
+            s.material = obj->materials[geometry.material_ids[geometry.bvh.indices[h.primitive]]];
+        }
+        return s;
+    }
 };
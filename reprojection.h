@@ -0,0 +1,153 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include "vec3.h"
+#include "helper.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+// when only the camera moved, the samples accumulated in the last frame are moved to where their surface is seen now
+// a new pixel look up the previous frame at the projection of its first hit, bilinear over the 4 pixels around
+// a tap is dropped when its surface is not the same one, the point was hidden before or is a different object
+bool temporal_reprojection = true;
+// history of a reprojected pixel is cut to this many samples so view dependent shading follow the camera
+const float REPROJECT_MAX_SAMPLES = 32;
+// a tap is the same surface if its position is closer to the tangent plane of the pixel than this fraction of the distance to the camera
+// the plane and not the point, at grazing angles a pixel cover a long piece of surface
+const float REPROJECT_POSITION_TOLERANCE = 0.02f;
+// and its normal is within this cosine
+const float REPROJECT_MIN_NORMAL_COSINE = 0.9f;
+// history color is clamped to the mean of the new samples around the pixel, plus or minus this many standard deviations
+const float REPROJECT_CLAMP_SIGMA = 1.0f;
+
+class Reprojector {
+private:
+    int w = 0;
+    int h = 0;
+    // result of the pass, copied back once every row is done since the pass read the new samples of neighbour rows
+    std::vector<Pixel> pixels;
+    std::vector<SurfaceSample> surfaces;
+    std::atomic<int> kept_count;
+    std::atomic<int> surface_count;
+    float kept = 0;
+    // REPROJECT_MAX_SAMPLES, less when the previous frame was smaller since each of its samples cover more surface
+    float max_samples = REPROJECT_MAX_SAMPLES;
+
+    static Vec3 unit(Vec3 v) {
+        return v.squared_length() > 1e-6f ? v.normalize() : VEC3_ZERO;
+    }
+    // box of the new samples in the 3x3 pixels around (x, y), per channel
+    void neighbour_box(const Framebuffer &frame, int x, int y, Vec3 &low, Vec3 &high) const {
+        Vec3 sum = VEC3_ZERO;
+        Vec3 square_sum = VEC3_ZERO;
+        float count = 0;
+        for(int qy = std::max(y - 1, 0); qy <= std::min(y + 1, h - 1); qy++)
+            for(int qx = std::max(x - 1, 0); qx <= std::min(x + 1, w - 1); qx++) {
+                Vec3 c = frame.color(qx, qy);
+                sum += c;
+                square_sum += c * c;
+                count += 1;
+            }
+        Vec3 mean = sum / count;
+        Vec3 variance = square_sum / count - mean * mean;
+        Vec3 sigma(sqrt(fmax(variance.x, 0.0f)), sqrt(fmax(variance.y, 0.0f)), sqrt(fmax(variance.z, 0.0f)));
+        low = mean - sigma * REPROJECT_CLAMP_SIGMA;
+        high = mean + sigma * REPROJECT_CLAMP_SIGMA;
+    }
+    // true if a history was found, the pixel is then the new samples blended on top of it
+    bool reproject_pixel(const Framebuffer &frame, const Framebuffer &previous, const Camera &previous_camera, int x, int y, Pixel &out, SurfaceSample &out_surface) const {
+        const SurfaceSample &s = frame.surface(x, y);
+        Vec3 normal = unit(s.normal);
+        if(normal == VEC3_ZERO) return false;
+        float px, py;
+        if(!previous_camera.project(s.position, px, py)) return false;
+
+        int x0 = floor(px);
+        int y0 = floor(py);
+        float fx = px - x0;
+        float fy = py - y0;
+        float tolerance = REPROJECT_POSITION_TOLERANCE * s.depth;
+        Vec3 color = VEC3_ZERO;
+        float moment = 0;
+        float samples = 0;
+        float weight_sum = 0;
+        SurfaceSample history;
+        for(int k = 0; k < 4; k++) {
+            int qx = x0 + (k & 1);
+            int qy = y0 + (k >> 1);
+            if(qx < 0 or qy < 0 or qx >= previous.width() or qy >= previous.height()) continue;
+            const SurfaceSample &q = previous.surface(qx, qy);
+            if(normal.dot(unit(q.normal)) < REPROJECT_MIN_NORMAL_COSINE) continue;
+            if(fabs((q.position - s.position).dot(normal)) > tolerance) continue;
+            float weight = (k & 1 ? fx : 1 - fx) * (k >> 1 ? fy : 1 - fy);
+            if(weight <= 0) continue;
+            const Pixel &p = previous.at(qx, qy);
+            color += p.color() * weight;
+            moment += p.luminance_moment * weight;
+            samples += p.samples * weight;
+            weight_sum += weight;
+            history.blend(q, weight / weight_sum);
+        }
+        if(weight_sum < 1e-3f) return false;
+        color /= weight_sum;
+        moment /= weight_sum;
+        samples = fmin(samples / weight_sum, max_samples);
+
+        // shading that changed with the view or a surface the tests missed stay within the noise of the new samples
+        Vec3 low = VEC3_ZERO, high = VEC3_ZERO;
+        neighbour_box(frame, x, y, low, high);
+        color = Vec3(fmin(fmax(color.x, low.x), high.x), fmin(fmax(color.y, low.y), high.y), fmin(fmax(color.z, low.z), high.z));
+
+        const Pixel &fresh = frame.at(x, y);
+        float wf = fresh.samples / (samples + fresh.samples);
+        out.set(color * (1 - wf) + fresh.color() * wf, samples + fresh.samples, moment * (1 - wf) + fresh.luminance_moment * wf);
+        out_surface = history;
+        out_surface.blend(s, wf);
+        return true;
+    }
+public:
+    Reprojector() : kept_count(0), surface_count(0) {}
+
+    // frame hold the new samples of the current camera, previous the last published frame seen from previous_camera
+    void apply(Framebuffer &frame, const Framebuffer &previous, const Camera &previous_camera, ThreadPool &pool) {
+        w = frame.width();
+        h = frame.height();
+        max_samples = REPROJECT_MAX_SAMPLES * fmin(1.0f, previous.width() * previous.height() / (float)(w * h));
+        pixels.resize(w * h);
+        surfaces.resize(w * h);
+        kept_count = 0;
+        surface_count = 0;
+        pool.run(h, [&](int y, int worker) {
+            int count = 0;
+            int hits = 0;
+            for(int x = 0; x < w; x++) {
+                int i = y * w + x;
+                // the sky is the same from anywhere, a new sample is already exact
+                if(frame.surface(x, y).depth > 0) hits++;
+                if(reproject_pixel(frame, previous, previous_camera, x, y, pixels[i], surfaces[i])) count++;
+                else {
+                    pixels[i] = frame.at(x, y);
+                    surfaces[i] = frame.surface(x, y);
+                }
+            }
+            kept_count += count;
+            surface_count += hits;
+        });
+        pool.run(h, [&](int y, int worker) {
+            for(int x = 0; x < w; x++) {
+                frame.at(x, y) = pixels[y * w + x];
+                frame.surface(x, y) = surfaces[y * w + x];
+            }
+        });
+        kept = surface_count > 0 ? kept_count / (float)surface_count : 0;
+    }
+    // fraction of the pixels showing a surface that found a history in the last apply
+    float kept_fraction() const {
+        return kept;
+    }
+};
+
+// reprojection of the frames drawn while the camera move
+Reprojector reprojector;
@@ -0,0 +1,226 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "constant.h"
+#include "helper.h"
+
+// where the numbers of a path come from
+enum SAMPLER_TYPE {
+    SAMPLER_RANDOM = 0,      // independent hashed numbers
+    SAMPLER_SOBOL = 1,       // owen scrambled sobol, scrambled per pixel
+    SAMPLER_BLUE_NOISE = 2,  // the same scrambled sobol in every pixel, shifted by a blue noise mask
+};
+int sampler_type = SAMPLER_SOBOL;
+
+// numbers a path takes at each bounce, so the same dimension is used for the same decision in every path
+// pairs (0, 1), (2, 3), ... are stratified together, the two numbers of a 2D choice go in one pair
+enum SAMPLE_DIMENSION {
+    DIMENSION_LENS = 0,     // bounce 0, 2 numbers
+    DIMENSION_LIGHT = 0,    // 2 numbers for the point on the light, then 1 to pick it
+    DIMENSION_BSDF = 4,     // 2 numbers for the direction, then 1 to pick the lobe or the refraction
+    DIMENSION_ROULETTE = 7,
+    DIMENSIONS_PER_BOUNCE = 8,
+};
+
+// side of the blue noise mask, it tile the screen
+const int BLUE_NOISE_SIZE = 64;
+
+// threshold mask made by void and cluster, each value is the rank of its pixel in [0, 1)
+// pixels of close values are spread evenly so the error of neighbour pixels do not add up
+class BlueNoise {
+private:
+    std::vector<float> mask;
+
+    static int wrap(int v) {
+        return (v + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+    }
+public:
+    BlueNoise() {
+        const int n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+        // gaussian of the toroidal distance, sigma 1.5 as in the original paper
+        std::vector<float> kernel(n);
+        for(int y = 0; y < BLUE_NOISE_SIZE; y++)
+            for(int x = 0; x < BLUE_NOISE_SIZE; x++) {
+                int dx = std::min(x, BLUE_NOISE_SIZE - x);
+                int dy = std::min(y, BLUE_NOISE_SIZE - y);
+                kernel[y * BLUE_NOISE_SIZE + x] = exp(-(dx * dx + dy * dy) / (2 * 1.5f * 1.5f));
+            }
+        std::vector<char> on(n, 0);
+        std::vector<float> energy(n, 0);
+        auto toggle = [&](int i, bool value) {
+            on[i] = value;
+            float sign = value ? 1 : -1;
+            int px = i % BLUE_NOISE_SIZE;
+            int py = i / BLUE_NOISE_SIZE;
+            for(int y = 0; y < BLUE_NOISE_SIZE; y++)
+                for(int x = 0; x < BLUE_NOISE_SIZE; x++)
+                    energy[y * BLUE_NOISE_SIZE + x] += sign * kernel[wrap(y - py) * BLUE_NOISE_SIZE + wrap(x - px)];
+        };
+        // tightest cluster is the set pixel of most energy, largest void the empty pixel of least
+        auto find = [&](bool value) {
+            int best = -1;
+            for(int i = 0; i < n; i++)
+                if(on[i] == value and (best == -1 or (value ? energy[i] > energy[best] : energy[i] < energy[best])))
+                    best = i;
+            return best;
+        };
+
+        // random initial pattern of a tenth of the pixels, spread by moving clusters into voids
+        RandomStream rng(0, 0);
+        int initial = n / 10;
+        for(int count = 0; count < initial;) {
+            int i = rng.next_uint() % n;
+            if(on[i]) continue;
+            toggle(i, true);
+            count++;
+        }
+        while(true) {
+            int cluster = find(true);
+            toggle(cluster, false);
+            int hole = find(false);
+            toggle(hole, true);
+            if(hole == cluster) break;
+        }
+        std::vector<char> pattern = on;
+        std::vector<float> pattern_energy = energy;
+
+        // ranks below the pattern by removing clusters, above it by filling voids
+        // on a torus the largest void is also the tightest cluster of empty pixels, one loop do both later phases
+        std::vector<int> rank(n);
+        for(int r = initial - 1; r >= 0; r--) {
+            int cluster = find(true);
+            toggle(cluster, false);
+            rank[cluster] = r;
+        }
+        on = pattern;
+        energy = pattern_energy;
+        for(int r = initial; r < n; r++) {
+            int hole = find(false);
+            toggle(hole, true);
+            rank[hole] = r;
+        }
+        mask.resize(n);
+        for(int i = 0; i < n; i++)
+            mask[i] = (rank[i] + 0.5f) / n;
+    }
+    float value(int x, int y) const {
+        return mask[(y & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE + (x & (BLUE_NOISE_SIZE - 1))];
+    }
+};
+
+// built once, the first time the blue noise sampler is used
+inline const BlueNoise& blue_noise() {
+    static const BlueNoise mask;
+    return mask;
+}
+
+inline uint32_t reverse_bits(uint32_t v) {
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+    v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+    return (v >> 16) | (v << 16);
+}
+// hash where every bit only depend on the bits below it, Laine and Karras
+inline uint32_t laine_karras_permutation(uint32_t v, uint32_t seed) {
+    v += seed;
+    v ^= v * 0x6c50b47cu;
+    v ^= v * 0xb82f1e52u;
+    v ^= v * 0xc7afe638u;
+    v ^= v * 0x8d22f6e6u;
+    return v;
+}
+// owen scrambling, a random permutation of every subtree of the binary digits
+inline uint32_t nested_uniform_scramble(uint32_t v, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(v), seed));
+}
+
+// first two sobol dimensions, a (0, 2) sequence: every power of two prefix is stratified in 2D
+// the first one is the index with its bits reversed, the second one use the polynomial x + 1 with m = 1
+class SobolMatrices {
+private:
+    // xor of the direction numbers selected by each byte of the index, 4 lookups instead of 32 steps
+    uint32_t bytes[4][256];
+public:
+    SobolMatrices() {
+        uint32_t directions[32];
+        for(int k = 0; k < 32; k++)
+            directions[k] = k == 0 ? 1u << 31 : directions[k - 1] ^ (directions[k - 1] >> 1);
+        for(int b = 0; b < 4; b++)
+            for(int v = 0; v < 256; v++) {
+                bytes[b][v] = 0;
+                for(int k = 0; k < 8; k++)
+                    if(v >> k & 1) bytes[b][v] ^= directions[b * 8 + k];
+            }
+    }
+    uint32_t sample(uint32_t index, int dimension) const {
+        if(dimension == 0) return reverse_bits(index);
+        return bytes[0][index & 0xff] ^ bytes[1][index >> 8 & 0xff] ^ bytes[2][index >> 16 & 0xff] ^ bytes[3][index >> 24];
+    }
+};
+const SobolMatrices sobol_matrices;
+
+// padded owen scrambled sobol as in "Practical Hash-based Owen Scrambling", Burley 2020
+// each pair of dimensions is its own 2D sobol sequence, the order of the points shuffled by the pair
+// so the pairs are not correlated with each other
+inline uint32_t scrambled_sobol(uint32_t index, uint32_t dimension, uint32_t seed) {
+    uint32_t pair_seed = pcg_hash(seed ^ pcg_hash(dimension >> 1));
+    uint32_t shuffled = nested_uniform_scramble(index, pair_seed);
+    uint32_t v = sobol_matrices.sample(shuffled, dimension & 1);
+    return nested_uniform_scramble(v, pcg_hash(pair_seed ^ (dimension & 1)));
+}
+
+// numbers of one path, indexed by pixel, sample and dimension
+// like RandomStream no state is shared between threads, a frame does not depend on the thread count
+class Sampler {
+private:
+    int type;
+    int x;
+    int y;
+    uint32_t pixel_seed;
+    uint32_t sample;
+    uint32_t dimension = 0;
+    RandomStream random;
+    const BlueNoise* mask = nullptr;
+public:
+    Sampler(int px, int py, uint32_t sample_index)
+        : type(sampler_type), x(px), y(py), sample(sample_index), random(px + py * MAX_WIDTH, sample_index) {
+        pixel_seed = pcg_hash(px + py * MAX_WIDTH);
+        if(type == SAMPLER_BLUE_NOISE) mask = &blue_noise();
+        set_bounce(0);
+    }
+    void set_bounce(uint32_t bounce) {
+        random.set_bounce(bounce);
+        dimension = bounce * DIMENSIONS_PER_BOUNCE;
+    }
+    // jump to a decision of the current bounce, its numbers do not depend on which decisions came before
+    void set_dimension(uint32_t d) {
+        dimension = dimension - dimension % DIMENSIONS_PER_BOUNCE + d;
+    }
+    // in [0, 1), 24 bits so the float is exact
+    float next_float() {
+        uint32_t d = dimension++;
+        uint32_t v;
+        switch(type) {
+            case SAMPLER_SOBOL:
+                v = scrambled_sobol(sample, d, pixel_seed);
+                break;
+            case SAMPLER_BLUE_NOISE: {
+                // rotation by the mask value at a place that change with the dimension
+                uint32_t offset = pcg_hash(d);
+                float shift = mask->value(x + (offset & 0xff), y + (offset >> 8 & 0xff));
+                v = scrambled_sobol(sample, d, 0) + (uint32_t)(shift * 4294967296.0);
+                break;
+            }
+            default:
+                return random.next_float();
+        }
+        return (v >> 8) * (1.0f / 16777216.0f);
+    }
+};
+
+inline float random_val(Sampler &rng) {
+    return rng.next_float();
+}
@@ -0,0 +1,210 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "vec3.h"
+#include "objects.h"
+#include "bvh.h"
+#include "ray.h"
+#include "sphere_simd.h"
+
+// structure used to trace spheres, selectable at runtime
+enum SPHERE_ACCELERATION {
+    SPHERE_BVH = 0,   // spheres are part of the scene BVH
+    SPHERE_GRID = 1,  // spheres are in a uniform grid, meshes stay in the scene BVH
+};
+int sphere_acceleration = SPHERE_BVH;
+
+// average number of spheres per cell used to choose the resolution
+const float GRID_DENSITY = 2.0f;
+// spheres bigger than this times the median radius are left out of the grid
+const float GRID_LARGE_SPHERE = 8.0f;
+const int GRID_MAX_CELLS = 1 << 22;
+
+// uniform grid for a lot of similar sized spheres
+// each cell list the spheres overlapping it, rays walk the cells with 3D-DDA
+class SphereGrid {
+private:
+    Vec3 grid_min = VEC3_ZERO;
+    Vec3 grid_max = VEC3_ZERO;
+    Vec3 cell_size = Vec3(1, 1, 1);
+    int res[3] = {0, 0, 0};
+    std::vector<std::vector<int>> cells;
+    // box each sphere was inserted with
+    std::vector<AABB> boxes;
+    // centre and radius of spheres, same index as spheres
+    SphereSoA packed;
+
+    int clamp_cell(float v, int axis) {
+        int c = (v - grid_min[axis]) / cell_size[axis];
+        return c < 0 ? 0 : (c >= res[axis] ? res[axis] - 1 : c);
+    }
+    int cell_index(int x, int y, int z) {
+        return (z * res[1] + y) * res[0] + x;
+    }
+    void insert(int id, const AABB &box, bool remove) {
+        int lo[3], hi[3];
+        for(int axis = 0; axis < 3; axis++) {
+            lo[axis] = clamp_cell(box.min[axis], axis);
+            hi[axis] = clamp_cell(box.max[axis], axis);
+        }
+        for(int z = lo[2]; z <= hi[2]; z++)
+            for(int y = lo[1]; y <= hi[1]; y++)
+                for(int x = lo[0]; x <= hi[0]; x++) {
+                    std::vector<int> &cell = cells[cell_index(x, y, z)];
+                    if(remove) {
+                        std::vector<int>::iterator it = std::find(cell.begin(), cell.end(), id);
+                        if(it != cell.end()) {
+                            *it = cell.back();
+                            cell.pop_back();
+                        }
+                    }
+                    else cell.push_back(id);
+                }
+    }
+    bool inside_grid(const AABB &box) {
+        for(int axis = 0; axis < 3; axis++)
+            if(box.min[axis] < grid_min[axis] or box.max[axis] > grid_max[axis]) return false;
+        return true;
+    }
+    static AABB box_of(Object* obj) {
+        AABB box;
+        box.min = obj->AABB_min;
+        box.max = obj->AABB_max;
+        return box;
+    }
+public:
+    std::vector<Object*> spheres;
+    // spheres too big for the cells (a ground sphere for example), traced with the scene BVH
+    std::vector<Object*> large;
+    // the spheres the grid was built from, to detect added or removed ones
+    std::vector<Object*> candidates;
+
+    void build(const std::vector<Object*> &scene_spheres) {
+        candidates = scene_spheres;
+        spheres.clear();
+        large.clear();
+        std::vector<float> radii;
+        for(Object* obj: scene_spheres)
+            radii.push_back(fabs(obj->get_radius()));
+        float median = 0;
+        if(!radii.empty()) {
+            std::nth_element(radii.begin(), radii.begin() + radii.size() / 2, radii.end());
+            median = radii[radii.size() / 2];
+        }
+        for(Object* obj: scene_spheres) {
+            if(fabs(obj->get_radius()) > GRID_LARGE_SPHERE * median) large.push_back(obj);
+            else spheres.push_back(obj);
+        }
+
+        int n = spheres.size();
+        boxes.resize(n);
+
+        AABB bounds;
+        for(int i = 0; i < n; i++) {
+            boxes[i] = box_of(spheres[i]);
+            bounds.grow(boxes[i]);
+        }
+        cells.clear();
+        if(n == 0) {
+            res[0] = res[1] = res[2] = 0;
+            return;
+        }
+        // a bit of room so small moves stay inside the grid
+        Vec3 margin = (bounds.max - bounds.min) * 0.05f + Vec3(1e-3f, 1e-3f, 1e-3f);
+        grid_min = bounds.min - margin;
+        grid_max = bounds.max + margin;
+
+        // cubic cells, about GRID_DENSITY spheres per cell
+        Vec3 extent = grid_max - grid_min;
+        float volume = extent.x * extent.y * extent.z;
+        float side = cbrt(volume * GRID_DENSITY / n);
+        long total = 1;
+        for(int axis = 0; axis < 3; axis++) {
+            res[axis] = std::max(1, std::min(1024, (int)(extent[axis] / side)));
+            total *= res[axis];
+        }
+        while(total > GRID_MAX_CELLS) {
+            total = 1;
+            for(int axis = 0; axis < 3; axis++) {
+                res[axis] = std::max(1, res[axis] / 2);
+                total *= res[axis];
+            }
+        }
+        cell_size = Vec3(extent.x / res[0], extent.y / res[1], extent.z / res[2]);
+
+        cells.assign(total, std::vector<int>());
+        for(int i = 0; i < n; i++)
+            insert(i, boxes[i], false);
+        packed.clear();
+        for(Object* obj: spheres) packed.add(obj);
+        packed.pad();
+    }
+    // move the spheres whose box changed to their new cells
+    // false if one left the grid, then it has to be rebuilt
+    bool update() {
+        if(cells.empty()) return spheres.empty();
+        for(int i = 0; i < (int)spheres.size(); i++) {
+            AABB box = box_of(spheres[i]);
+            if(box.min == boxes[i].min and box.max == boxes[i].max) continue;
+            if(!inside_grid(box)) return false;
+            insert(i, boxes[i], true);
+            insert(i, box, false);
+            boxes[i] = box;
+            packed.set(i, spheres[i]);
+        }
+        return true;
+    }
+    bool need_rebuild(const std::vector<Object*> &scene_spheres) {
+        return scene_spheres != candidates;
+    }
+
+    // walk the cells along the ray, visit(cell, t_exit) return true to stop
+    template<typename F>
+    void walk(Ray &ray, F visit) {
+        if(cells.empty()) return;
+        Vec3 inv_dir = ray.safe_inverse_direction();
+        float t_enter = ray.distance_to_AABB(grid_min, grid_max, inv_dir);
+        if(t_enter == INFINITY) return;
+
+        Vec3 p = ray.origin + ray.direction * t_enter;
+        int cell[3], step[3];
+        float t_next[3], t_delta[3];
+        for(int axis = 0; axis < 3; axis++) {
+            cell[axis] = clamp_cell(p[axis], axis);
+            // direction from inv_dir and not the ray, a -0 component must step down like its -1e30 inverse
+            bool forward = inv_dir[axis] >= 0;
+            step[axis] = forward ? 1 : -1;
+            float boundary = grid_min[axis] + (cell[axis] + forward) * cell_size[axis];
+            t_next[axis] = (boundary - ray.origin[axis]) * inv_dir[axis];
+            t_delta[axis] = cell_size[axis] * fabs(inv_dir[axis]);
+        }
+        while(true) {
+            int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+            float t_exit = t_next[axis];
+            if(visit(cells[cell_index(cell[0], cell[1], cell[2])], t_exit)) return;
+            if(t_exit > ray.max_range) return;
+
+            cell[axis] += step[axis];
+            if(cell[axis] < 0 or cell[axis] >= res[axis]) return;
+            t_next[axis] += t_delta[axis];
+        }
+    }
+    // a hit inside the current cell can not be beaten by a later cell
+    HitInfo cast(Ray &ray, const MediumStack &medium) {
+        HitInfo closest;
+        walk(ray, [&](const std::vector<int> &cell, float t_exit) {
+            HitInfo h = ray.cast_to_spheres(packed, cell.data(), 0, cell.size(), medium);
+            if(h.did_hit and h.distance < closest.distance) closest = h;
+            return closest.distance <= t_exit;
+        });
+        return closest;
+    }
+    bool occluded(Ray &ray) {
+        bool blocked = false;
+        walk(ray, [&](const std::vector<int> &cell, float t_exit) {
+            blocked = occluded_by_spheres(packed, cell.data(), 0, cell.size(), ray.origin, ray.direction, ray.max_range);
+            return blocked;
+        });
+        return blocked;
+    }
+};
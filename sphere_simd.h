@@ -0,0 +1,204 @@
+#pragma once
+#include <vector>
+#include <stdint.h>
+#include "vec3.h"
+#include "constant.h"
+#include "objects.h"
+#include "medium.h"
+#include "triangle_simd.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// closest sphere found by a kernel
+struct SphereHit {
+    int index = -1;
+    float distance = INFINITY;
+    bool inside = false;
+};
+
+// sphere centres and radii in structure of arrays layout, read without virtual call
+// an entry that is not a sphere (a mesh of the scene BVH) has a NaN radius and never hit
+// arrays are padded so a kernel can always load 8 lanes
+class SphereSoA {
+public:
+    std::vector<float> cx, cy, cz, r;
+    std::vector<Object*> objects;
+
+    void clear() {
+        cx.clear(); cy.clear(); cz.clear(); r.clear();
+        objects.clear();
+    }
+    void add(Object* obj) {
+        cx.push_back(0); cy.push_back(0); cz.push_back(0); r.push_back(NAN);
+        objects.push_back(obj);
+        set(objects.size() - 1, obj);
+    }
+    // refresh entry i after the object moved
+    void set(int i, Object* obj) {
+        objects[i] = obj;
+        if(!obj or !obj->is_sphere()) return;
+        Vec3 c = obj->get_position();
+        cx[i] = c.x; cy[i] = c.y; cz[i] = c.z;
+        r[i] = obj->get_radius();
+    }
+    void pad() {
+        for(int i = 0; i < 8; i++) add(nullptr);
+    }
+    int size() const {
+        return (int)objects.size() - 8;
+    }
+    // index of a padding entry, used to fill unused lanes of a gather
+    int empty_index() const {
+        return size();
+    }
+};
+
+// the root depends on the side of the sphere the path is, like Ray::cast_to_sphere
+inline void select_sphere_root(const SphereSoA &s, int i, float near, float far, float max_range,
+                               const MediumStack &medium, SphereHit &best) {
+    Object* obj = s.objects[i];
+    if(!obj->visible) return;
+    bool inside = medium.inside(obj);
+    float distance = inside ? far : near;
+    if(distance < 0 or distance > max_range or distance >= best.distance) return;
+    best.index = i;
+    best.distance = distance;
+    best.inside = inside;
+}
+inline bool sphere_blocks(const SphereSoA &s, int i, float near, float far, float max_range) {
+    if(!s.objects[i]->visible) return false;
+    return (near > 0 and near <= max_range) or (far > 0 and far <= max_range);
+}
+// both roots of one sphere, false if the ray line miss it
+inline bool sphere_roots(const SphereSoA &s, int i, Vec3 o, Vec3 d, float &near, float &far) {
+    Vec3 offset_origin = o - Vec3(s.cx[i], s.cy[i], s.cz[i]);
+    float a = d.squared_length();
+    float b = offset_origin.dot(d);
+    float c = offset_origin.squared_length() - s.r[i] * s.r[i];
+    float D = b * b - a * c;
+    if(!(D >= 0)) return false;
+    float sqrt_D = sqrt(D);
+    near = (-b - sqrt_D) / a;
+    far = (-b + sqrt_D) / a;
+    return true;
+}
+
+// test spheres ids[0, count) and keep the closest hit in best
+// ids is null for the contiguous range [first, first + count)
+inline void intersect_spheres_scalar(const SphereSoA &s, const int* ids, int first, int count,
+                                     Vec3 o, Vec3 d, float max_range, const MediumStack &medium, SphereHit &best) {
+    for(int k = 0; k < count; k++) {
+        int i = ids ? ids[k] : first + k;
+        float near, far;
+        if(sphere_roots(s, i, o, d, near, far))
+            select_sphere_root(s, i, near, far, max_range, medium, best);
+    }
+}
+inline bool occluded_by_spheres_scalar(const SphereSoA &s, const int* ids, int first, int count,
+                                       Vec3 o, Vec3 d, float max_range) {
+    for(int k = 0; k < count; k++) {
+        int i = ids ? ids[k] : first + k;
+        float near, far;
+        if(sphere_roots(s, i, o, d, near, far) and sphere_blocks(s, i, near, far, max_range)) return true;
+    }
+    return false;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+// roots of 8 spheres, returns the bit mask of lanes where the ray line hit
+inline int sphere_roots_avx2(__m256 cx, __m256 cy, __m256 cz, __m256 r, Vec3 o, Vec3 d, __m256 a, __m256 &near, __m256 &far) {
+    __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(o.x), cx);
+    __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(o.y), cy);
+    __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(o.z), cz);
+    __m256 b = _mm256_fmadd_ps(ocz, _mm256_set1_ps(d.z), _mm256_fmadd_ps(ocy, _mm256_set1_ps(d.y), _mm256_mul_ps(ocx, _mm256_set1_ps(d.x))));
+    __m256 c = _mm256_fmsub_ps(ocz, ocz, _mm256_fmsub_ps(r, r, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx))));
+    __m256 D = _mm256_fmsub_ps(b, b, _mm256_mul_ps(a, c));
+    int bits = _mm256_movemask_ps(_mm256_cmp_ps(D, _mm256_setzero_ps(), _CMP_GE_OQ));
+    if(bits == 0) return 0;
+    __m256 sqrt_D = _mm256_sqrt_ps(D);
+    __m256 minus_b = _mm256_sub_ps(_mm256_setzero_ps(), b);
+    near = _mm256_div_ps(_mm256_sub_ps(minus_b, sqrt_D), a);
+    far = _mm256_div_ps(_mm256_add_ps(minus_b, sqrt_D), a);
+    return bits;
+}
+// roots of the 8 spheres starting at k, from a contiguous range or gathered from ids
+// index receive the sphere of every lane, lanes past count are masked out
+inline int sphere_batch_avx2(const SphereSoA &s, const int* ids, int first, int k, int count,
+                             Vec3 o, Vec3 d, __m256 a, __m256 &near, __m256 &far, int index[8]) {
+    int bits;
+    if(!ids) {
+        int i = first + k;
+        bits = sphere_roots_avx2(_mm256_loadu_ps(&s.cx[i]), _mm256_loadu_ps(&s.cy[i]), _mm256_loadu_ps(&s.cz[i]),
+                                 _mm256_loadu_ps(&s.r[i]), o, d, a, near, far);
+        for(int j = 0; j < 8; j++) index[j] = i + j;
+    }
+    else {
+        for(int j = 0; j < 8; j++) index[j] = k + j < count ? ids[k + j] : s.empty_index();
+        __m256i lanes = _mm256_loadu_si256((const __m256i*)index);
+        bits = sphere_roots_avx2(_mm256_i32gather_ps(s.cx.data(), lanes, 4), _mm256_i32gather_ps(s.cy.data(), lanes, 4),
+                                 _mm256_i32gather_ps(s.cz.data(), lanes, 4), _mm256_i32gather_ps(s.r.data(), lanes, 4),
+                                 o, d, a, near, far);
+    }
+    if(count - k < 8) bits &= (1 << (count - k)) - 1;
+    return bits;
+}
+inline void intersect_spheres_avx2(const SphereSoA &s, const int* ids, int first, int count,
+                                   Vec3 o, Vec3 d, float max_range, const MediumStack &medium, SphereHit &best) {
+    const __m256 a = _mm256_set1_ps(d.squared_length());
+    for(int k = 0; k < count; k += 8) {
+        __m256 near, far;
+        int index[8];
+        int bits = sphere_batch_avx2(s, ids, first, k, count, o, d, a, near, far, index);
+        if(bits == 0) continue;
+        float nears[8], fars[8];
+        _mm256_storeu_ps(nears, near);
+        _mm256_storeu_ps(fars, far);
+        for(int j = 0; j < 8; j++)
+            if(bits >> j & 1) select_sphere_root(s, index[j], nears[j], fars[j], max_range, medium, best);
+    }
+}
+inline bool occluded_by_spheres_avx2(const SphereSoA &s, const int* ids, int first, int count,
+                                     Vec3 o, Vec3 d, float max_range) {
+    const __m256 a = _mm256_set1_ps(d.squared_length());
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 range = _mm256_set1_ps(max_range);
+    for(int k = 0; k < count; k += 8) {
+        __m256 near, far;
+        int index[8];
+        int bits = sphere_batch_avx2(s, ids, first, k, count, o, d, a, near, far, index);
+        if(bits == 0) continue;
+        __m256 near_in = _mm256_and_ps(_mm256_cmp_ps(near, zero, _CMP_GT_OQ), _mm256_cmp_ps(near, range, _CMP_LE_OQ));
+        __m256 far_in = _mm256_and_ps(_mm256_cmp_ps(far, zero, _CMP_GT_OQ), _mm256_cmp_ps(far, range, _CMP_LE_OQ));
+        bits &= _mm256_movemask_ps(_mm256_or_ps(near_in, far_in));
+        for(int j = 0; j < 8; j++)
+            if((bits >> j & 1) and s.objects[index[j]]->visible) return true;
+    }
+    return false;
+}
+#endif
+
+// spheres follow the triangle kernel choice, SSE and AVX2 without FMA use the scalar path
+// short lists are faster without the lane setup, gathered ones (a grid cell) even more
+inline bool use_sphere_simd(const int* ids, int count) {
+    return triangle_kernel == KERNEL_AVX2 and count >= (ids ? 16 : 4);
+}
+inline void intersect_spheres(const SphereSoA &s, const int* ids, int first, int count,
+                              Vec3 o, Vec3 d, float max_range, const MediumStack &medium, SphereHit &best) {
+#if defined(__AVX2__) && defined(__FMA__)
+    if(use_sphere_simd(ids, count)) {
+        intersect_spheres_avx2(s, ids, first, count, o, d, max_range, medium, best);
+        return;
+    }
+#endif
+    intersect_spheres_scalar(s, ids, first, count, o, d, max_range, medium, best);
+}
+inline bool occluded_by_spheres(const SphereSoA &s, const int* ids, int first, int count,
+                                Vec3 o, Vec3 d, float max_range) {
+#if defined(__AVX2__) && defined(__FMA__)
+    if(use_sphere_simd(ids, count))
+        return occluded_by_spheres_avx2(s, ids, first, count, o, d, max_range);
+#endif
+    return occluded_by_spheres_scalar(s, ids, first, count, o, d, max_range);
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <atomic>
+
+// workers stay alive between frames and wait for the next batch of tasks
+// run() split the task indices in one contiguous range per worker,
+// a worker that empty its range steal half of the remaining range of another one
+class ThreadPool {
+public:
+    // worker times of the last batch, copied so the gui can read them while the pool is resized
+    struct Stats {
+        int workers = 0;
+        double utilization = 0;
+        std::vector<float> busy_ms;
+        std::vector<int> steals;
+    };
+private:
+    // tasks not started yet of one worker, the owner take from the front and thieves from the back
+    struct TaskQueue {
+        std::mutex mutex;
+        int begin = 0;
+        int end = 0;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    // current batch, generation is bumped so sleeping workers know a new batch started
+    std::function<void(int, int)> task;
+    int active = 0;
+    long generation = 0;
+    bool stopping = false;
+
+    // nanoseconds spent in tasks and ranges stolen by every worker during the last batch
+    std::vector<long long> busy;
+    std::vector<int> steals;
+    Stats last_stats;
+
+    bool pop(int worker, int &i) {
+        TaskQueue &q = *queues[worker];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if(q.begin >= q.end) return false;
+        i = q.begin++;
+        return true;
+    }
+    bool steal(int worker) {
+        int n = queues.size();
+        for(int k = 1; k < n; k++) {
+            TaskQueue &victim = *queues[(worker + k) % n];
+            int from, to;
+            {
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                int left = victim.end - victim.begin;
+                if(left <= 0) continue;
+                to = victim.end;
+                victim.end -= (left + 1) / 2;
+                from = victim.end;
+            }
+            TaskQueue &own = *queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.begin = from;
+            own.end = to;
+            steals[worker]++;
+            return true;
+        }
+        return false;
+    }
+
+    // seen is the generation when the worker was made, it only wake for batches started after
+    void worker_loop(int worker, long seen) {
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping or generation != seen; });
+                if(stopping) return;
+                seen = generation;
+            }
+            long long time = 0;
+            int i;
+            while(pop(worker, i) or (steal(worker) and pop(worker, i))) {
+                auto start = std::chrono::steady_clock::now();
+                task(i, worker);
+                auto end = std::chrono::steady_clock::now();
+                time += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+            }
+            busy[worker] = time;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if(--active == 0) done.notify_one();
+        }
+    }
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(std::thread &t: workers) t.join();
+        workers.clear();
+        stopping = false;
+    }
+public:
+    ~ThreadPool() {
+        stop();
+    }
+    // must not be called while run() is in progress
+    void resize(int count) {
+        if(count < 1) count = 1;
+        if(count == size()) return;
+        stop();
+        busy.assign(count, 0);
+        steals.assign(count, 0);
+        queues.clear();
+        for(int i = 0; i < count; i++)
+            queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+        long current;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = generation;
+        }
+        for(int i = 0; i < count; i++)
+            workers.push_back(std::thread(&ThreadPool::worker_loop, this, i, current));
+    }
+    int size() const {
+        return workers.size();
+    }
+    // call f(task, worker) for every task in [0, count) and wait for all of them
+    void run(int count, std::function<void(int, int)> f) {
+        if(workers.empty()) resize(default_size());
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = f;
+            int n = workers.size();
+            for(int w = 0; w < n; w++) {
+                std::lock_guard<std::mutex> queue_lock(queues[w]->mutex);
+                queues[w]->begin = (long)count * w / n;
+                queues[w]->end = (long)count * (w + 1) / n;
+                steals[w] = 0;
+            }
+            active = n;
+            generation++;
+        }
+        wake.notify_all();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return active == 0; });
+        auto end = std::chrono::steady_clock::now();
+
+        long long wall = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        long long total = 0;
+        last_stats.workers = workers.size();
+        last_stats.busy_ms.clear();
+        for(long long b: busy) {
+            total += b;
+            last_stats.busy_ms.push_back(b / 1e6);
+        }
+        last_stats.steals = steals;
+        // busy time of the workers over the wall time, from 0 to 1
+        last_stats.utilization = wall > 0 ? total / ((double)wall * workers.size()) : 0;
+    }
+    // times of the last run, busy_ms is the time every worker spent in tasks in milliseconds
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return last_stats;
+    }
+    static int default_size() {
+        int n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 4;
+    }
+};
+
+// render workers, resized by the draw thread when render_thread_count change
+// the count is set by the gui thread, so it is atomic
+ThreadPool render_pool;
+std::atomic<int> render_thread_count(ThreadPool::default_size());
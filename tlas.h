@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+#include "vec3.h"
+#include "objects.h"
+#include "bvh.h"
+#include "bvh8.h"
+#include "sphere_simd.h"
+
+// spheres of a leaf are tested 8 at a time, so leaves are cheap compared to nodes
+const float TLAS_INTERSECTION_COST = 0.125f;
+
+// top level acceleration structure
+// a BVH over the bounding box of every object in the scene,
+// each leaf then lead to the object own intersection (mesh BVH or sphere)
+class TLAS {
+private:
+    std::vector<AABB> boxes;
+public:
+    BVH bvh;
+    // same leaves as bvh, walked when bvh_layout is BVH_WIDE8
+    BVH8 bvh8;
+    std::vector<Object*> objects;
+    // objects in BVH order so a leaf is a contiguous range of sphere data
+    SphereSoA spheres;
+
+    // true if an object was added, removed or its bounding box changed
+    bool need_rebuild(const std::vector<Object*> &scene_objects) {
+        if(scene_objects.size() != objects.size()) return true;
+        for(int i = 0; i < (int)objects.size(); i++) {
+            Object* obj = scene_objects[i];
+            if(obj != objects[i]
+                    or obj->AABB_min != boxes[i].min
+                    or obj->AABB_max != boxes[i].max)
+                return true;
+        }
+        return false;
+    }
+    // invisible objects are kept so that toggling visibility does not need a rebuild
+    void build(const std::vector<Object*> &scene_objects) {
+        objects = scene_objects;
+        boxes.resize(objects.size());
+        for(int i = 0; i < (int)objects.size(); i++) {
+            boxes[i].min = objects[i]->AABB_min;
+            boxes[i].max = objects[i]->AABB_max;
+        }
+        bvh.build(boxes, TLAS_INTERSECTION_COST);
+        bvh8.build(bvh);
+
+        spheres.clear();
+        for(int i = 0; i < (int)bvh.indices.size(); i++)
+            spheres.add(objects[bvh.indices[i]]);
+        spheres.pad();
+    }
+};
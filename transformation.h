@@ -73,3 +73,85 @@ inline Vec3 _rotate_on_axis(Vec3 v, Vec3 u, float t) {
 inline Vec3 _scale(Vec3 u, Vec3 v) {
     return u * v;
 }
+
+// affine transformation, a 3x3 linear part m and a translation t
+// a point p is mapped to m * p + t
+class Transform {
+public:
+    float m[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    Vec3 t = VEC3_ZERO;
+
+    // build the linear part from the image of the 3 basis vectors
+    static Transform linear(Vec3 c0, Vec3 c1, Vec3 c2) {
+        Transform tf;
+        for(int i = 0; i < 3; i++) {
+            tf.m[i][0] = c0[i];
+            tf.m[i][1] = c1[i];
+            tf.m[i][2] = c2[i];
+        }
+        return tf;
+    }
+    static Transform translation(Vec3 v) {
+        Transform tf;
+        tf.t = v;
+        return tf;
+    }
+    static Transform scaling(Vec3 v) {
+        return linear(Vec3(v.x, 0, 0), Vec3(0, v.y, 0), Vec3(0, 0, v.z));
+    }
+    static Transform rotation(Vec3 a) {
+        return linear(_rotate(Vec3(1, 0, 0), a), _rotate(Vec3(0, 1, 0), a), _rotate(Vec3(0, 0, 1), a));
+    }
+    static Transform rotation_y(float a) {
+        return linear(_rotate_y(Vec3(1, 0, 0), a), _rotate_y(Vec3(0, 1, 0), a), _rotate_y(Vec3(0, 0, 1), a));
+    }
+    static Transform rotation_on_axis(Vec3 u, float a) {
+        return linear(_rotate_on_axis(Vec3(1, 0, 0), u, a), _rotate_on_axis(Vec3(0, 1, 0), u, a), _rotate_on_axis(Vec3(0, 0, 1), u, a));
+    }
+
+    Vec3 vector(const Vec3 &v) const {
+        return Vec3(
+            m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z
+        );
+    }
+    Vec3 point(const Vec3 &p) const {
+        return vector(p) + t;
+    }
+    // multiply by the transpose of the linear part
+    // normals are mapped to world space with the transpose of the inverse
+    Vec3 transposed_vector(const Vec3 &v) const {
+        return Vec3(
+            m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+            m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+            m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z
+        );
+    }
+    Transform inverse() const {
+        Transform inv;
+        float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                  - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                  + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        float inv_det = 1 / det;
+        inv.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+        inv.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        inv.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        inv.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+        inv.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        inv.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        inv.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+        inv.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        inv.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+        inv.t = -inv.vector(t);
+        return inv;
+    }
+};
+inline Transform operator*(const Transform &a, const Transform &b) {
+    Transform c;
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            c.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+    c.t = a.point(b.t);
+    return c;
+}
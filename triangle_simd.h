@@ -0,0 +1,247 @@
+#pragma once
+#include <vector>
+#include "vec3.h"
+#include "constant.h"
+
+#if defined(__SSE4_1__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// triangle intersection kernels, selectable at runtime for benchmarking
+enum TRIANGLE_KERNEL {
+    KERNEL_SCALAR = 0,
+    KERNEL_SSE = 1,   // 4 triangles per test
+    KERNEL_AVX2 = 2,  // 8 triangles per test
+};
+inline bool triangle_kernel_available(int kernel) {
+    switch(kernel) {
+        case KERNEL_SCALAR:
+            return true;
+#ifdef __SSE4_1__
+        case KERNEL_SSE:
+            return true;
+#endif
+#ifdef __AVX2__
+        case KERNEL_AVX2:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+inline int best_triangle_kernel() {
+    if(triangle_kernel_available(KERNEL_AVX2)) return KERNEL_AVX2;
+    if(triangle_kernel_available(KERNEL_SSE)) return KERNEL_SSE;
+    return KERNEL_SCALAR;
+}
+int triangle_kernel = best_triangle_kernel();
+
+// closest triangle found by a kernel
+struct TriangleHit {
+    int index = -1;
+    float distance = INFINITY;
+    float u = 0;
+    float v = 0;
+};
+
+// triangles in structure of arrays layout with edges and normal precomputed
+// stored in BVH order so that a leaf is a contiguous range
+// arrays are padded so a kernel can always load 8 lanes
+class TriangleSoA {
+public:
+    std::vector<float> v0x, v0y, v0z;
+    std::vector<float> e1x, e1y, e1z;
+    std::vector<float> e2x, e2y, e2z;
+    // e1 x e2, normal of the front face scaled by twice the area
+    std::vector<float> nx, ny, nz;
+
+    void add(Vec3 a, Vec3 b, Vec3 c) {
+        Vec3 e1 = b - a;
+        Vec3 e2 = c - a;
+        Vec3 n = e1.cross(e2);
+        v0x.push_back(a.x); v0y.push_back(a.y); v0z.push_back(a.z);
+        e1x.push_back(e1.x); e1y.push_back(e1.y); e1z.push_back(e1.z);
+        e2x.push_back(e2.x); e2y.push_back(e2.y); e2z.push_back(e2.z);
+        nx.push_back(n.x); ny.push_back(n.y); nz.push_back(n.z);
+    }
+    void pad() {
+        std::vector<float>* arrays[12] = {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &nx, &ny, &nz};
+        for(int i = 0; i < 12; i++) arrays[i]->resize(arrays[i]->size() + 8, 0.0f);
+    }
+    int size() const {
+        return (int)v0x.size() - 8;
+    }
+    Vec3 normal(int i) const {
+        return Vec3(nx[i], ny[i], nz[i]).normalize();
+    }
+};
+
+// test triangles [first, first + count) and keep the closest hit in best
+// single sided ray-triangle test, sign = -1 accept hits on the back face instead
+// and sign = 0 accept both faces
+inline void intersect_triangles_scalar(const TriangleSoA &t, int first, int count,
+                                       Vec3 o, Vec3 d, float sign, float max_range, TriangleHit &best) {
+    for(int i = first; i < first + count; i++) {
+        Vec3 e1 = Vec3(t.e1x[i], t.e1y[i], t.e1z[i]);
+        Vec3 e2 = Vec3(t.e2x[i], t.e2y[i], t.e2z[i]);
+        Vec3 n = Vec3(t.nx[i], t.ny[i], t.nz[i]);
+        Vec3 ao = o - Vec3(t.v0x[i], t.v0y[i], t.v0z[i]);
+        Vec3 dao = ao.cross(d);
+
+        float determinant = -d.dot(n);
+        float invDet = 1 / determinant;
+        float dst = ao.dot(n) * invDet;
+        float u = e2.dot(dao) * invDet;
+        float v = -e1.dot(dao) * invDet;
+        float w = 1 - u - v;
+        float facing = sign == 0 ? fabs(determinant) : sign * determinant;
+        if(facing >= 1e-6 and dst >= 0 and dst <= max_range and dst < best.distance
+                and u >= 0 and v >= 0 and w >= 0) {
+            best.index = i;
+            best.distance = dst;
+            best.u = u;
+            best.v = v;
+        }
+    }
+}
+
+#ifdef __SSE4_1__
+inline void intersect_triangles_sse(const TriangleSoA &t, int first, int count,
+                                    Vec3 o, Vec3 d, float sign, float max_range, TriangleHit &best) {
+    const __m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+    const __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 eps = _mm_set1_ps(1e-6f);
+    const __m128 sgn = _mm_set1_ps(sign);
+    const __m128 sign_bit = _mm_set1_ps(-0.0f);
+    const bool two_sided = sign == 0;
+    const __m128 range = _mm_set1_ps(max_range);
+    const __m128 lane = _mm_setr_ps(0, 1, 2, 3);
+
+    for(int i = first; i < first + count; i += 4) {
+        __m128 e1x = _mm_loadu_ps(&t.e1x[i]), e1y = _mm_loadu_ps(&t.e1y[i]), e1z = _mm_loadu_ps(&t.e1z[i]);
+        __m128 e2x = _mm_loadu_ps(&t.e2x[i]), e2y = _mm_loadu_ps(&t.e2y[i]), e2z = _mm_loadu_ps(&t.e2z[i]);
+        __m128 nx = _mm_loadu_ps(&t.nx[i]), ny = _mm_loadu_ps(&t.ny[i]), nz = _mm_loadu_ps(&t.nz[i]);
+        __m128 aox = _mm_sub_ps(ox, _mm_loadu_ps(&t.v0x[i]));
+        __m128 aoy = _mm_sub_ps(oy, _mm_loadu_ps(&t.v0y[i]));
+        __m128 aoz = _mm_sub_ps(oz, _mm_loadu_ps(&t.v0z[i]));
+        // dao = ao x d
+        __m128 daox = _mm_sub_ps(_mm_mul_ps(aoy, dz), _mm_mul_ps(aoz, dy));
+        __m128 daoy = _mm_sub_ps(_mm_mul_ps(aoz, dx), _mm_mul_ps(aox, dz));
+        __m128 daoz = _mm_sub_ps(_mm_mul_ps(aox, dy), _mm_mul_ps(aoy, dx));
+
+        __m128 det = _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny)), _mm_mul_ps(dz, nz)));
+        __m128 inv_det = _mm_div_ps(one, det);
+        __m128 dst = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(aox, nx), _mm_mul_ps(aoy, ny)), _mm_mul_ps(aoz, nz)), inv_det);
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, daox), _mm_mul_ps(e2y, daoy)), _mm_mul_ps(e2z, daoz)), inv_det);
+        __m128 v = _mm_sub_ps(zero, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, daox), _mm_mul_ps(e1y, daoy)), _mm_mul_ps(e1z, daoz)), inv_det));
+        __m128 w = _mm_sub_ps(_mm_sub_ps(one, u), v);
+
+        __m128 facing = two_sided ? _mm_andnot_ps(sign_bit, det) : _mm_mul_ps(sgn, det);
+        __m128 mask = _mm_cmpge_ps(facing, eps);
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(dst, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(dst, range));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(dst, _mm_set1_ps(best.distance)));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(w, zero));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(lane, _mm_set1_ps((float)(first + count - i))));
+
+        int bits = _mm_movemask_ps(mask);
+        if(bits == 0) continue;
+        float dsts[4], us[4], vs[4];
+        _mm_storeu_ps(dsts, dst);
+        _mm_storeu_ps(us, u);
+        _mm_storeu_ps(vs, v);
+        for(int k = 0; k < 4; k++)
+            if((bits >> k & 1) and dsts[k] < best.distance) {
+                best.index = i + k;
+                best.distance = dsts[k];
+                best.u = us[k];
+                best.v = vs[k];
+            }
+    }
+}
+#endif
+
+#ifdef __AVX2__
+inline void intersect_triangles_avx2(const TriangleSoA &t, int first, int count,
+                                     Vec3 o, Vec3 d, float sign, float max_range, TriangleHit &best) {
+    const __m256 ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y), oz = _mm256_set1_ps(o.z);
+    const __m256 dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y), dz = _mm256_set1_ps(d.z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 eps = _mm256_set1_ps(1e-6f);
+    const __m256 sgn = _mm256_set1_ps(sign);
+    const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+    const bool two_sided = sign == 0;
+    const __m256 range = _mm256_set1_ps(max_range);
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for(int i = first; i < first + count; i += 8) {
+        __m256 e1x = _mm256_loadu_ps(&t.e1x[i]), e1y = _mm256_loadu_ps(&t.e1y[i]), e1z = _mm256_loadu_ps(&t.e1z[i]);
+        __m256 e2x = _mm256_loadu_ps(&t.e2x[i]), e2y = _mm256_loadu_ps(&t.e2y[i]), e2z = _mm256_loadu_ps(&t.e2z[i]);
+        __m256 nx = _mm256_loadu_ps(&t.nx[i]), ny = _mm256_loadu_ps(&t.ny[i]), nz = _mm256_loadu_ps(&t.nz[i]);
+        __m256 aox = _mm256_sub_ps(ox, _mm256_loadu_ps(&t.v0x[i]));
+        __m256 aoy = _mm256_sub_ps(oy, _mm256_loadu_ps(&t.v0y[i]));
+        __m256 aoz = _mm256_sub_ps(oz, _mm256_loadu_ps(&t.v0z[i]));
+        // dao = ao x d
+        // same operations in the same order as the other kernels and no fused multiply add, which round differently
+        // hits are then the same as the SSE and scalar kernels when built with -ffp-contract=off
+        // with the default flags the compiler fuse some of them, a ray on a shared edge can hit in one kernel only
+        __m256 daox = _mm256_sub_ps(_mm256_mul_ps(aoy, dz), _mm256_mul_ps(aoz, dy));
+        __m256 daoy = _mm256_sub_ps(_mm256_mul_ps(aoz, dx), _mm256_mul_ps(aox, dz));
+        __m256 daoz = _mm256_sub_ps(_mm256_mul_ps(aox, dy), _mm256_mul_ps(aoy, dx));
+
+        __m256 det = _mm256_sub_ps(zero, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, nx), _mm256_mul_ps(dy, ny)), _mm256_mul_ps(dz, nz)));
+        __m256 inv_det = _mm256_div_ps(one, det);
+        __m256 dst = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(aox, nx), _mm256_mul_ps(aoy, ny)), _mm256_mul_ps(aoz, nz)), inv_det);
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, daox), _mm256_mul_ps(e2y, daoy)), _mm256_mul_ps(e2z, daoz)), inv_det);
+        __m256 v = _mm256_sub_ps(zero, _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, daox), _mm256_mul_ps(e1y, daoy)), _mm256_mul_ps(e1z, daoz)), inv_det));
+        __m256 w = _mm256_sub_ps(_mm256_sub_ps(one, u), v);
+
+        __m256 facing = two_sided ? _mm256_andnot_ps(sign_bit, det) : _mm256_mul_ps(sgn, det);
+        __m256 mask = _mm256_cmp_ps(facing, eps, _CMP_GE_OQ);
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(dst, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(dst, range, _CMP_LE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(dst, _mm256_set1_ps(best.distance), _CMP_LT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(w, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(lane, _mm256_set1_ps((float)(first + count - i)), _CMP_LT_OQ));
+
+        int bits = _mm256_movemask_ps(mask);
+        if(bits == 0) continue;
+        float dsts[8], us[8], vs[8];
+        _mm256_storeu_ps(dsts, dst);
+        _mm256_storeu_ps(us, u);
+        _mm256_storeu_ps(vs, v);
+        for(int k = 0; k < 8; k++)
+            if((bits >> k & 1) and dsts[k] < best.distance) {
+                best.index = i + k;
+                best.distance = dsts[k];
+                best.u = us[k];
+                best.v = vs[k];
+            }
+    }
+}
+#endif
+
+inline void intersect_triangles(const TriangleSoA &t, int first, int count,
+                                Vec3 o, Vec3 d, float sign, float max_range, TriangleHit &best) {
+    switch(triangle_kernel) {
+#ifdef __AVX2__
+        case KERNEL_AVX2:
+            intersect_triangles_avx2(t, first, count, o, d, sign, max_range, best);
+            return;
+#endif
+#ifdef __SSE4_1__
+        case KERNEL_SSE:
+            intersect_triangles_sse(t, first, count, o, d, sign, max_range, best);
+            return;
+#endif
+        default:
+            intersect_triangles_scalar(t, first, count, o, d, sign, max_range, best);
+    }
+}
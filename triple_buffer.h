@@ -0,0 +1,45 @@
+#pragma once
+#include <atomic>
+
+// three frames shared by the render side and the display side without locks or copies
+// the renderer write in back and publish() swap it with the middle slot,
+// the display call acquire() to swap the middle slot with front when a newer frame is there
+// so each side always own the frame it is working on
+template<typename T>
+class TripleBuffer {
+private:
+    // bit set on the middle slot when it hold a frame the display has not taken yet
+    static const int FRESH = 4;
+
+    T frames[3];
+    std::atomic<int> middle;
+    // only touched by the render side
+    int back = 0;
+    int last = 1;
+    // only touched by the display side
+    int front = 2;
+public:
+    TripleBuffer() {
+        middle = 1;
+    }
+
+    // render side
+    T& back_frame() {
+        return frames[back];
+    }
+    // last published frame, read only, the display may be reading it too
+    const T& previous_frame() const {
+        return frames[last];
+    }
+    void publish() {
+        last = back;
+        back = middle.exchange(back | FRESH) & ~FRESH;
+    }
+
+    // display side, the returned frame stay valid until the next acquire()
+    const T& acquire() {
+        if(middle.load() & FRESH)
+            front = middle.exchange(front) & ~FRESH;
+        return frames[front];
+    }
+};
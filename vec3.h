@@ -31,6 +31,9 @@ public:
     Vec3 operator/=(const float t) {
         return *this *= 1/t;
     }
+    float operator[](const int i) const {
+        return i == 0 ? x : (i == 1 ? y : z);
+    }
     bool operator==(const Vec3 &v) {
         Vec3 u = *this;
         return u.x == v.x and u.y == v.y and u.z == v.z;